@@ -5,17 +5,26 @@
  *      manages access to that resource between many processes.
  */
 #include <assert.h>     // assert
+#include <errno.h>      // errno, EINTR
+#include <fcntl.h>      // open, O_RDWR
 #include <netinet/in.h> // sockaddr_in
 #include <poll.h>       // poll, struct pollfd
 #include <pthread.h>    // pthread_create, pthread_t
-#include <stdio.h>      // printf
-#include <string.h>     // strncmp
-#include <sys/socket.h> // socket, bind, listen, getsockname
-#include <unistd.h>     // getopt, daemon
+#include <stdio.h>      // printf, fopen, fscanf
+#include <stdlib.h>     // strtoul, malloc, free
+#include <string.h>     // strcmp, strncmp, strchr, strlen, strnlen, strpbrk,
+                        // memcpy, memchr
+#include <sys/socket.h> // socket, bind, listen, getsockname, send, recv
+#include <unistd.h>     // getopt, fork, pipe, setsid, dup2, _exit, sysconf
 
+#include "capture.h"
 #include "flock.h"
+#include "latency.h"
 #include "log.h"
+#include "notify.h"
+#include "resource.h"
 #include "threadpool.h"
+#include "timerwheel.h"
 
 
 
@@ -31,8 +40,31 @@
 #define FLOCK_POST_LEN      128
 #define SERVER_QUEUE        64
 #define SERVER_TIMEOUT      10 * 1000 // milliseconds
-#define SERVER_BUFLEN       1024
-#define SERVER_THREADS      64
+// Longest single command reply (stats), and the longest request and reply,
+// which are for a batch of SERVER_BATCH_OPS commands.
+#define SERVER_OPREPLYLEN   1024
+#define SERVER_REQUESTLEN   (SERVER_BATCH_OPS * \
+                             (RESOURCE_NAMELEN + RESOURCE_VALUELEN + 32) + 64)
+#define SERVER_REPLYLEN     (SERVER_BATCH_OPS * (SERVER_OPREPLYLEN + 1) + 32)
+#define SERVER_THREADS_MIN  4
+#define SERVER_THREADS_MAX  64
+#define SERVER_THREAD_STACK 256 * 1024 // bytes
+#define SERVER_SHARDS       16
+#define SERVER_PEEKLEN      32
+#define SERVER_PARKED       256
+#define SERVER_BATCH_OPS    32
+#define SERVER_SUBSCRIPTIONS 16
+#define SERVER_SUBSCRIBERS  1024
+#define SERVER_EVENTLEN     (RESOURCE_NAMELEN + RESOURCE_VALUELEN + 32)
+#define SERVER_TICK_MS      10
+#define SERVER_READ_TIMEOUT 5 * 1000 // milliseconds
+#define SERVER_WRITE_TIMEOUT 5 * 1000 // milliseconds
+
+// Each subscriber queues at most one event per resource, so as long as it
+// can't subscribe to more resources than fit in its queue none are dropped.
+#if SERVER_SUBSCRIPTIONS > NOTIFY_QUEUE_LENGTH
+  #error "SERVER_SUBSCRIPTIONS must not exceed NOTIFY_QUEUE_LENGTH"
+#endif
 
 
 
@@ -43,8 +75,109 @@
 typedef struct cl_opts_t
 {
     const char* log_file;
+    const char* capture_file;
 } cl_opts;
 
+typedef enum command_type_t
+{
+    COMMAND_UNKNOWN,
+    COMMAND_PRINT,
+    COMMAND_STATS,
+    COMMAND_GET,
+    COMMAND_SET,
+    COMMAND_CAS,
+} command_type;
+
+typedef enum deadline_kind_t
+{
+    DEADLINE_READ,
+    DEADLINE_WRITE,
+    DEADLINE_KINDS,
+} deadline_kind;
+
+/**
+ * \brief   A client connection accepted and waiting for a handler thread.
+ */
+typedef struct accepted_connection_t
+{
+    int fd;
+    /** Monotonic time the connection was accepted, in nanoseconds. */
+    uint64_t accepted;
+} accepted_connection;
+
+/**
+ * \brief   A client connection being processed by a handler thread.
+ */
+typedef struct connection_t
+{
+    int fd;
+    /** Deadline for the connection's current read or write. */
+    wheel_timer deadline;
+    /** What the armed deadline is guarding. */
+    deadline_kind kind;
+    /** Set (on the timer thread) if the deadline expired. */
+    int expired;
+} connection;
+
+/**
+ * \brief   A subscribed client connection. Owned by the handler thread which
+ *      created it until it is handed over to the push thread.
+ */
+typedef struct subscription_t
+{
+    connection conn;
+    notify_subscriber sub;
+    resource* res[SERVER_SUBSCRIPTIONS];
+    size_t res_length;
+    /** Event being sent, NULL if none, and how much of it has been sent. */
+    notify_event* sending;
+    size_t sent;
+    /** Set if the socket's buffer filled while sending. */
+    int blocked;
+    /** Set when an event has been queued. Protected by the pusher lock. */
+    int ready;
+    /** Set on the push thread to flush or close the subscription. */
+    int flush;
+    int closing;
+} subscription;
+
+/**
+ * \brief   The push thread and the subscriptions it owns.
+ */
+typedef struct pusher_t
+{
+    pthread_t thread;
+    /** Protects all fields below except subs and subs_length, which only the
+     *  push thread accesses. */
+    pthread_mutex_t lock;
+    /** Pipe written to wake the push thread. */
+    int wake_fds[2];
+    /** Set if the pipe has been written to since the push thread woke. */
+    int woken;
+    int running;
+    /** Number of subscriptions, including those still being set up. */
+    size_t count;
+    /** Subscriptions handed over but not yet adopted by the push thread. */
+    subscription* added[SERVER_SUBSCRIBERS];
+    size_t added_length;
+    subscription* subs[SERVER_SUBSCRIBERS];
+    size_t subs_length;
+} pusher_state;
+
+/**
+ * \brief   A parsed client command.
+ */
+typedef struct command_t
+{
+    command_type type;
+    /** Resource the command operates on, NULL if none. */
+    resource* res;
+    /** Value to write, for set and cas. */
+    const char* value;
+    /** Expected current version, for cas. */
+    unsigned long version;
+} command;
+
 
 
 /*
@@ -55,6 +188,20 @@ extern char *optarg;    // getopt
 extern int optind;      // getopt
 extern const char* log_file;    // log
 cl_opts program_opts;
+resource_table resources;
+threadpool pool;
+timerwheel timers;
+pusher_state pusher;
+capture_log capture = { -1 };
+unsigned long connections_expired[DEADLINE_KINDS];
+static const char* const priority_names[THREADPOOL_PRIORITIES] =
+{
+    "high", "normal", "low",
+};
+static const char* const deadline_names[DEADLINE_KINDS] =
+{
+    "read", "write",
+};
 
 
 
@@ -67,14 +214,17 @@ cl_opts program_opts;
  */
 void print_help(void)
 {
-    printf("Usage: acquired [-h] [-l LOG_FILE]\n");
+    printf("Usage: acquired [-h] [-l LOG_FILE] [-c CAPTURE_FILE]\n");
     printf("\n");
     printf("Starts the daemon if necessary and prints the port number on\n");
-    printf("which the daemon is listening for new connections.\n");
+    printf("which the daemon is listening for new connections. The daemon\n");
+    printf("hosts any number of named resources, created on first access.\n");
     printf("\n");
     printf("Optional arguments:\n");
     printf("  -h    Show this help message and exit.\n");
     printf("  -l    Path to the log file to use.\n");
+    printf("  -c    Path to a file to append every request to, for replay.\n");
+    printf("        Only applies if this invocation starts the daemon.\n");
 }
 
 /**
@@ -91,13 +241,15 @@ void parse_command_line(cl_opts* opts, int argc, char* const argv[])
 
     // Set defaults.
     opts->log_file = DEFAULT_LOG_FILE;
+    opts->capture_file = NULL;
 
     // Parse optional arguments.
-    while ((opt = getopt(argc, argv, "hl:")) >= 0)
+    while ((opt = getopt(argc, argv, "hl:c:")) >= 0)
     {
         switch (opt)
         {
             case 'l': opts->log_file = optarg; break;
+            case 'c': opts->capture_file = optarg; break;
             case 'h': print_help(); exit(0); break;
             default:  print_help(); exit(1); break;
         }
@@ -109,14 +261,45 @@ void parse_command_line(cl_opts* opts, int argc, char* const argv[])
 
 /**
  * \brief   Daemonize's the process. The parent process will successfully exit
- *      upon calling this function.
+ *      upon calling this function, once the daemon lock has been transferred
+ *      to the child (otherwise other processes would see the lock's owner
+ *      exit and break it).
+ *
+ * \param daemon_lock   The acquired daemon lock to transfer to the child.
  */
-void daemonize(void)
+void daemonize(flock* daemon_lock)
 {
+    int ready[2];
+    int null_fd;
+    char c;
+
     // Ensure all standard streams are flushed before daemonizing.
     fflush(stdout);
-    // Daemonize.
-    if (daemon(1, 0) < 0) DIE("Failed to daemonize");
+    if (pipe(ready) < 0) DIE("Failed to create daemonize pipe");
+    switch (fork())
+    {
+        case -1:
+            DIE("Failed to daemonize");
+        case 0:
+            break;
+        default:
+            // Wait for the child to close its end of the pipe.
+            close(ready[1]);
+            while (read(ready[0], &c, 1) < 0 && errno == EINTR) {}
+            _exit(0);
+    }
+
+    // Daemonize, as daemon(1, 0).
+    close(ready[0]);
+    if (setsid() < 0) DIE("Failed to create daemon session");
+    null_fd = open("/dev/null", O_RDWR);
+    if (null_fd < 0) DIE("Failed to open /dev/null");
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO) close(null_fd);
+    transfer_flock(daemon_lock);
+    close(ready[1]);
 }
 
 /**
@@ -167,80 +350,1113 @@ void get_port(char* port_s, int socket_fd)
     snprintf(port_s, 10, "%d", port);
 }
 
+/**
+ * \brief   Splits the next space separated word off a command.
+ *
+ * \param cmd   Pointer to the remaining command string. Updated to point past
+ *      the word and any following spaces. Not NULL.
+ * \return  The word, NUL terminated, or NULL if the command is exhausted.
+ */
+char* next_word(char** cmd)
+{
+    char* word = *cmd;
+    char* end;
+    while (*word == ' ') ++word;
+    if (*word == '\0') return NULL;
+    end = strchr(word, ' ');
+    if (end)
+    {
+        *end = '\0';
+        for (++end; *end == ' '; ++end) {}
+        *cmd = end;
+    }
+    else
+    {
+        *cmd = word + strlen(word);
+    }
+    return word;
+}
+
+/**
+ * \brief   Parses the optional scheduling header at the start of a request,
+ *      "@CLASS[:DEADLINE_MS] ", where CLASS is one of high, normal or low and
+ *      DEADLINE_MS is the number of milliseconds after the connection is
+ *      accepted by which the request should be started. Requests without a
+ *      header are normal priority with no deadline.
+ *
+ * \param req           The NUL terminated request. Not NULL.
+ * \param priority      Pointer to populate with the priority class. Not NULL.
+ * \param deadline_ms   Pointer to populate with the deadline, 0 if none. Not
+ *      NULL.
+ * \return  Pointer to the remainder of the request following the header.
+ */
+char* parse_schedule(char* req, threadpool_priority* priority,
+                     unsigned long* deadline_ms)
+{
+    size_t len;
+    *priority = THREADPOOL_PRIORITY_NORMAL;
+    *deadline_ms = 0;
+    if (req[0] != '@') return req;
+
+    ++req;
+    for (int p = 0; p < THREADPOOL_PRIORITIES; ++p)
+    {
+        len = strlen(priority_names[p]);
+        if (strncmp(req, priority_names[p], len) == 0 &&
+            (req[len] == ':' || req[len] == ' ' || req[len] == '\0'))
+        {
+            *priority = p;
+            req += len;
+            break;
+        }
+    }
+    if (*req == ':') *deadline_ms = strtoul(req + 1, &req, 10);
+    while (*req && *req != ' ') ++req;
+    while (*req == ' ') ++req;
+    return req;
+}
+
+/**
+ * \brief   Closes a connection whose deadline has expired. Shutting the socket
+ *      down (rather than closing it) fails any read or write the handler
+ *      thread is blocked in, leaving the handler to close the descriptor.
+ *      Called on the timer thread.
+ *
+ * \param conn_raw  Pointer to the connection.
+ */
+void expire_connection(void* conn_raw)
+{
+    connection* conn = conn_raw;
+    conn->expired = 1;
+    __atomic_add_fetch(&connections_expired[conn->kind], 1, __ATOMIC_RELAXED);
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+/**
+ * \brief   (Re-)arms a connection's deadline.
+ *
+ * \param conn  The connection. Not NULL.
+ * \param kind  What the deadline guards, which determines its timeout.
+ */
+void arm_deadline(connection* conn, deadline_kind kind)
+{
+    static const unsigned int timeouts[DEADLINE_KINDS] =
+    {
+        SERVER_READ_TIMEOUT, SERVER_WRITE_TIMEOUT,
+    };
+
+    // Cancel first so the timer thread never sees kind change underneath it.
+    timerwheel_cancel(&timers, &conn->deadline);
+    conn->kind = kind;
+    timerwheel_arm(&timers, &conn->deadline, timeouts[kind], expire_connection,
+                   conn);
+}
+
+/**
+ * \brief   Reads the daemon's resident set size.
+ *
+ * \return  The resident set size in kilobytes, 0 if it could not be read.
+ */
+unsigned long resident_kb(void)
+{
+    unsigned long pages = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%*u %lu", &pages) != 1) pages = 0;
+    fclose(fp);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * \brief   Formats the threadpool's per-priority class scheduling statistics,
+ *      the number of connections closed for missing each deadline and the
+ *      threadpool's size and the daemon's memory use.
+ *
+ * \param buf       Buffer to write the NUL terminated statistics into. Not
+ *      NULL.
+ * \param buflen    Length of the buffer.
+ */
+void format_stats(char* buf, size_t buflen)
+{
+    threadpool_stats stats[THREADPOOL_PRIORITIES];
+    threadpool_thread_stats thread_stats;
+    size_t len = 0;
+
+    threadpool_get_stats(&pool, stats);
+    for (int p = 0; p < THREADPOOL_PRIORITIES && len < buflen; ++p)
+    {
+        uint64_t mean = stats[p].started ? stats[p].wait_total / stats[p].started : 0;
+        len += snprintf(buf + len, buflen - len,
+            "%s%s started=%lu queued=%lu wait_mean_us=%lu wait_max_us=%lu "
+            "missed=%lu promoted=%lu", p ? "; " : "", priority_names[p],
+            stats[p].started, stats[p].queued, (unsigned long) (mean / 1000),
+            (unsigned long) (stats[p].wait_max / 1000),
+            stats[p].deadlines_missed, stats[p].starvation_promotions);
+    }
+    for (int k = 0; k < DEADLINE_KINDS && len < buflen; ++k)
+    {
+        len += snprintf(buf + len, buflen - len, "%s %s=%lu",
+            k ? "" : "; expired", deadline_names[k],
+            __atomic_load_n(&connections_expired[k], __ATOMIC_RELAXED));
+    }
+    threadpool_get_thread_stats(&pool, &thread_stats);
+    if (len < buflen)
+    {
+        snprintf(buf + len, buflen - len,
+            "; pool threads=%zu idle=%zu peak=%zu spawned=%lu retired=%lu "
+            "stack_kb=%zu rss_kb=%lu", thread_stats.threads, thread_stats.idle,
+            thread_stats.peak, thread_stats.spawned, thread_stats.retired,
+            thread_stats.stack_size / 1024, resident_kb());
+    }
+}
+
+/**
+ * \brief   Parses a single command. Commands are one of:
+ *      print                       Replies "hello world".
+ *      stats                       Replies "ok STATISTICS".
+ *      get RESOURCE                Replies "ok VERSION VALUE".
+ *      set RESOURCE VALUE          Replies "ok VERSION".
+ *      cas RESOURCE VERSION VALUE  Sets the value only if the resource is
+ *                                  currently at VERSION. Replies "ok VERSION".
+ *      Resources are created empty on first access. Failures reply
+ *      "err REASON".
+ *
+ * \param text      The NUL terminated command. Modified during parsing. Not
+ *      NULL.
+ * \param cmd       Pointer to the command struct to populate. Not NULL.
+ * \param reply     Buffer to write the NUL terminated reply into on failure.
+ *      Not NULL.
+ * \param replylen  Length of the reply buffer.
+ * \return  0 on success, < 0 if the command could not be parsed.
+ */
+int parse_command(char* text, command* cmd, char* reply, size_t replylen)
+{
+    char* verb = next_word(&text);
+    char* name;
+    char* end;
+
+    if      (verb == NULL)              cmd->type = COMMAND_UNKNOWN;
+    else if (strcmp(verb, "print") == 0) cmd->type = COMMAND_PRINT;
+    else if (strcmp(verb, "stats") == 0) cmd->type = COMMAND_STATS;
+    else if (strcmp(verb, "get") == 0)   cmd->type = COMMAND_GET;
+    else if (strcmp(verb, "set") == 0)   cmd->type = COMMAND_SET;
+    else if (strcmp(verb, "cas") == 0)   cmd->type = COMMAND_CAS;
+    else                                 cmd->type = COMMAND_UNKNOWN;
+    cmd->res = NULL;
+    if (cmd->type == COMMAND_UNKNOWN)
+    {
+        snprintf(reply, replylen, "err unknown command");
+        return -1;
+    }
+    if (cmd->type == COMMAND_PRINT || cmd->type == COMMAND_STATS)
+        return 0;
+
+    // Resource commands.
+    name = next_word(&text);
+    if (name == NULL || !resource_name_valid(name))
+    {
+        snprintf(reply, replylen, "err invalid resource name");
+        return -1;
+    }
+    if (cmd->type == COMMAND_CAS)
+    {
+        char* version = next_word(&text);
+        if (version == NULL || (cmd->version = strtoul(version, &end, 10),
+                                *end != '\0'))
+        {
+            snprintf(reply, replylen, "err invalid version");
+            return -1;
+        }
+    }
+    if (strlen(text) >= RESOURCE_VALUELEN)
+    {
+        snprintf(reply, replylen, "err value too long");
+        return -1;
+    }
+    cmd->value = text;
+    cmd->res = resource_lookup(&resources, name);
+    if (cmd->res == NULL)
+    {
+        dlog(LOG_ERROR, "Failed to look up resource %s", name);
+        snprintf(reply, replylen, "err failed to look up resource");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief   Executes a parsed command. The command's resource, if any, must be
+ *      locked.
+ *
+ * \param cmd       The parsed command. Not NULL.
+ * \param reply     Buffer to write the NUL terminated reply into. Not NULL.
+ * \param replylen  Length of the reply buffer.
+ * \return  0 on success, < 0 if the command failed.
+ */
+int execute_command(const command* cmd, char* reply, size_t replylen)
+{
+    char value[RESOURCE_VALUELEN];
+    unsigned long version;
+    int len;
+
+    switch (cmd->type)
+    {
+        case COMMAND_PRINT:
+            snprintf(reply, replylen, "%s", "hello world");
+            return 0;
+        case COMMAND_STATS:
+            len = snprintf(reply, replylen, "ok ");
+            format_stats(reply + len, replylen - len);
+            return 0;
+        case COMMAND_GET:
+            version = resource_read(cmd->res, value, RESOURCE_VALUELEN);
+            snprintf(reply, replylen, "ok %lu %s", version, value);
+            return 0;
+        case COMMAND_CAS:
+            if (cmd->res->version != cmd->version)
+            {
+                snprintf(reply, replylen, "err version is %lu", cmd->res->version);
+                return -1;
+            }
+            // Fall through.
+        case COMMAND_SET:
+            version = resource_write(cmd->res, cmd->value);
+            snprintf(reply, replylen, "ok %lu", version);
+            return 0;
+        default:
+            snprintf(reply, replylen, "err unknown command");
+            return -1;
+    }
+}
+
+/**
+ * \brief   Publishes a resource's current state to its subscribers. The event
+ *      is serialised once and shared by every subscriber. The resource must
+ *      be locked.
+ *
+ * \param res   The resource which has changed. Not NULL.
+ */
+void publish_change(resource* res)
+{
+    char buf[SERVER_EVENTLEN];
+    notify_event* event;
+    int len;
+
+    if (res->subscribers == NULL) return;
+    len = snprintf(buf, SERVER_EVENTLEN, "event %s %lu %s\n", res->name,
+                   res->version, res->value);
+    event = notify_event_create(res, buf, len);
+    if (event == NULL)
+    {
+        dlog(LOG_ERROR, "Failed to create change event for %s", res->name);
+        return;
+    }
+    notify_publish(res->subscribers, event);
+    notify_event_release(event);
+}
+
+/**
+ * \brief   Determines whether a parsed command modifies its resource.
+ */
+int is_write(const command* cmd)
+{
+    return cmd->type == COMMAND_SET || cmd->type == COMMAND_CAS;
+}
+
+/**
+ * \brief   Parses and executes a single command. See parse_command.
+ *
+ * \param text      The NUL terminated command. Modified during parsing. Not
+ *      NULL.
+ * \param reply     Buffer to write the NUL terminated reply into. Not NULL.
+ * \param replylen  Length of the reply buffer.
+ * \return  0 on success, < 0 if the command failed.
+ */
+int perform_command(char* text, char* reply, size_t replylen)
+{
+    command cmd;
+    int ret;
+
+    if (parse_command(text, &cmd, reply, replylen) < 0) return -1;
+    if (cmd.res) resource_lock_all(&cmd.res, 1);
+    ret = execute_command(&cmd, reply, replylen);
+    if (ret == 0 && is_write(&cmd)) publish_change(cmd.res);
+    if (cmd.res) resource_unlock_all(&cmd.res, 1);
+    return ret;
+}
+
+/**
+ * \brief   Appends a command's reply as a new line of a batch reply.
+ *
+ * \param reply     The batch reply. Not NULL.
+ * \param replylen  Length of the batch reply buffer.
+ * \param len       Pointer to the length of the batch reply so far, updated.
+ * \param opreply   The command's reply. Not NULL.
+ * \return  0 on success, < 0 if the reply does not fit, in which case the
+ *      batch reply is left unchanged.
+ */
+int append_reply(char* reply, size_t replylen, size_t* len, const char* opreply)
+{
+    size_t oplen = strlen(opreply);
+    if (*len + 1 + oplen >= replylen) return -1;
+    reply[(*len)++] = '\n';
+    memcpy(reply + *len, opreply, oplen + 1);
+    *len += oplen;
+    return 0;
+}
+
+/**
+ * \brief   Performs a batch of commands, one per line, in order and replies
+ *      "ok N" followed by each command's reply on its own line. If atomic, the
+ *      resources of every command are locked for the whole batch and if any
+ *      command fails every change made by the batch is undone and the reply is
+ *      "err batch aborted at op I: REASON" instead.
+ *
+ * \param text      The NUL terminated, newline separated commands. Modified
+ *      during parsing. Not NULL.
+ * \param atomic    Non-zero to apply the batch all-or-nothing.
+ * \param reply     Buffer to write the NUL terminated reply into. Not NULL.
+ * \param replylen  Length of the reply buffer.
+ * \return  0 on success, < 0 if any command failed.
+ */
+int perform_batch(char* text, int atomic, char* reply, size_t replylen)
+{
+    char* lines[SERVER_BATCH_OPS];
+    command cmds[SERVER_BATCH_OPS];
+    resource* locked[SERVER_BATCH_OPS];
+    struct { char value[RESOURCE_VALUELEN]; unsigned long version; }
+        undo[SERVER_BATCH_OPS];
+    char opreply[SERVER_OPREPLYLEN];
+    size_t ops = 0, locked_length = 0, len;
+    int ret = 0, failed_cas;
+    char* save = NULL;
+
+    // Split the batch into commands.
+    for (char* line = strtok_r(text, "\r\n", &save); line;
+         line = strtok_r(NULL, "\r\n", &save))
+    {
+        if (ops == SERVER_BATCH_OPS)
+        {
+            snprintf(reply, replylen, "err batch exceeds %d ops", SERVER_BATCH_OPS);
+            return -1;
+        }
+        lines[ops++] = line;
+    }
+
+    len = snprintf(reply, replylen, "ok %zu", ops);
+    if (!atomic)
+    {
+        for (size_t i = 0; i < ops; ++i)
+        {
+            if (perform_command(lines[i], opreply, SERVER_OPREPLYLEN) < 0) ret = -1;
+            if (append_reply(reply, replylen, &len, opreply) < 0)
+            {
+                snprintf(reply, replylen, "err reply too long");
+                return -1;
+            }
+        }
+        return ret;
+    }
+
+    // Atomic: parse every command before touching any resource.
+    for (size_t i = 0; i < ops; ++i)
+    {
+        if (parse_command(lines[i], &cmds[i], opreply, SERVER_OPREPLYLEN) < 0)
+        {
+            snprintf(reply, replylen, "err batch aborted at op %zu: %s", i,
+                     opreply + 4);
+            return -1;
+        }
+        if (cmds[i].res) locked[locked_length++] = cmds[i].res;
+    }
+
+    // Lock every resource in the batch, then execute, recording each
+    // command's prior state so the batch can be undone.
+    resource_lock_all(locked, locked_length);
+    for (size_t i = 0; i < ops; ++i)
+    {
+        if (cmds[i].res)
+            undo[i].version = resource_read(cmds[i].res, undo[i].value,
+                                            RESOURCE_VALUELEN);
+        ret = execute_command(&cmds[i], opreply, SERVER_OPREPLYLEN);
+        failed_cas = ret < 0 && cmds[i].type == COMMAND_CAS;
+        if (ret == 0 && append_reply(reply, replylen, &len, opreply) < 0)
+        {
+            snprintf(opreply, SERVER_OPREPLYLEN, "err reply too long");
+            ret = -1;
+        }
+        if (ret < 0)
+        {
+            // Undo this command and those before it in reverse so resources
+            // touched more than once end up in their original state.
+            for (size_t j = i + 1; j-- > 0;)
+            {
+                if (cmds[j].res == NULL) continue;
+                snprintf(cmds[j].res->value, RESOURCE_VALUELEN, "%s",
+                         undo[j].value);
+                cmds[j].res->version = undo[j].version;
+            }
+            // A cas can only fail on its version. Report the version which is
+            // left committed, which a retry has to match, rather than one
+            // produced by the batch's own writes which have just been undone.
+            if (failed_cas)
+                snprintf(opreply, SERVER_OPREPLYLEN, "err version is %lu",
+                         cmds[i].res->version);
+            snprintf(reply, replylen, "err batch aborted at op %zu: %s", i,
+                     opreply + 4);
+            break;
+        }
+    }
+
+    // Only once the whole batch has succeeded, notify subscribers of the
+    // final state of each resource it wrote.
+    for (size_t i = 0; i < ops && ret == 0; ++i)
+    {
+        int last_write = is_write(&cmds[i]);
+        for (size_t j = i + 1; j < ops && last_write; ++j)
+            if (cmds[j].res == cmds[i].res && is_write(&cmds[j]))
+                last_write = 0;
+        if (last_write) publish_change(cmds[i].res);
+    }
+    resource_unlock_all(locked, locked_length);
+    return ret;
+}
+
+/**
+ * \brief   Determines whether a request starts with the given verb.
+ *
+ * \param req   The NUL terminated request. Not NULL.
+ * \param verb  The verb to match. Not NULL.
+ * \return  Non-zero if req starts with verb followed by whitespace or the end
+ *      of the request.
+ */
+int starts_with_verb(const char* req, const char* verb)
+{
+    size_t len = strlen(verb);
+    return strncmp(req, verb, len) == 0 &&
+        (req[len] == ' ' || req[len] == '\r' || req[len] == '\n' ||
+         req[len] == '\0');
+}
+
+/**
+ * \brief   Reads a whole request from a client. A request ends with a NUL
+ *      byte, or when the client shuts down its side of the connection.
+ *
+ * \param client_fd The client connection.
+ * \param buf       Buffer to read the request into, which is NUL terminated.
+ *      Not NULL.
+ * \param buflen    Length of the buffer.
+ * \return  The number of bytes read, including any terminating NUL (0 if the
+ *      client sent nothing). -1 on error, -2 if the request is too long for
+ *      the buffer, in which case the rest of it has been discarded.
+ */
+int read_request(int client_fd, char* buf, size_t buflen)
+{
+    size_t len = 0;
+    for (;;)
+    {
+        ssize_t ret;
+        if (len == buflen - 1)
+        {
+            // Too long: discard the rest so the client sees the error reply
+            // rather than a reset connection.
+            while ((ret = read(client_fd, buf, buflen - 1)) > 0 &&
+                   memchr(buf, '\0', ret) == NULL) {}
+            return -2;
+        }
+        ret = read(client_fd, buf + len, buflen - 1 - len);
+        if (ret < 0) return -1;
+        if (ret == 0) break;
+        len += ret;
+        if (memchr(buf + len - ret, '\0', ret)) break;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/**
+ * \brief   Sends a whole buffer to a client, without raising SIGPIPE if the
+ *      client has gone away.
+ *
+ * \return  0 on success, < 0 on error.
+ */
+int send_all(int client_fd, const char* buf, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t ret = send(client_fd, buf, length, MSG_NOSIGNAL);
+        if (ret <= 0) return -1;
+        buf += ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Subscriptions. Subscribed connections are handed from their handler thread
+ * to a single push thread which polls every subscriber's socket and sends
+ * queued events as their sockets become writable, so subscribers never hold
+ * a handler thread.
+ */
+
+/**
+ * \brief   Marks a subscription as having events queued and wakes the push
+ *      thread. Called by notify_publish with resource and subscriber locks
+ *      held, so must not block.
+ */
+void wake_pusher(void* subscription_raw)
+{
+    subscription* s = subscription_raw;
+    pthread_mutex_lock(&pusher.lock);
+    s->ready = 1;
+    if (!pusher.woken)
+    {
+        pusher.woken = 1;
+        if (write(pusher.wake_fds[1], "", 1) < 0)
+            dlog(LOG_WARNING, "Failed to wake push thread");
+    }
+    pthread_mutex_unlock(&pusher.lock);
+}
+
+/**
+ * \brief   Counts the open subscriptions.
+ */
+size_t count_subscriptions(void)
+{
+    size_t count;
+    pthread_mutex_lock(&pusher.lock);
+    count = pusher.count;
+    pthread_mutex_unlock(&pusher.lock);
+    return count;
+}
+
+/**
+ * \brief   Subscribes a subscription to (or unsubscribes it from) each of its
+ *      resources.
+ */
+void subscribe_all(subscription* s, int subscribe)
+{
+    for (size_t i = 0; i < s->res_length; ++i)
+    {
+        resource_lock_all(&s->res[i], 1);
+        if (!subscribe)
+            notify_unsubscribe(&s->res[i]->subscribers, &s->sub);
+        else if (notify_subscribe(&s->res[i]->subscribers, &s->sub) < 0)
+            dlog(LOG_ERROR, "Failed to subscribe to %s", s->res[i]->name);
+        resource_unlock_all(&s->res[i], 1);
+    }
+}
+
+/**
+ * \brief   Frees a subscription, unsubscribing it and freeing its slot. Its
+ *      connection must already have been closed.
+ */
+void free_subscription(subscription* s)
+{
+    subscribe_all(s, 0);
+    if (s->sending) notify_event_release(s->sending);
+    dlog(LOG_INFO, "Client unsubscribed, %lu events coalesced, %lu dropped",
+         s->sub.coalesced, s->sub.dropped);
+    notify_subscriber_destroy(&s->sub);
+    free(s);
+
+    pthread_mutex_lock(&pusher.lock);
+    pusher.count--;
+    pthread_mutex_unlock(&pusher.lock);
+}
+
+/**
+ * \brief   Sends a subscription's queued events until they have all been sent
+ *      or its socket's buffer is full. An event which cannot be sent in full
+ *      straight away has SERVER_WRITE_TIMEOUT to finish sending. Only called
+ *      on the push thread.
+ *
+ * \return  0 on success, < 0 if the connection has failed.
+ */
+int flush_subscription(subscription* s)
+{
+    for (;;)
+    {
+        ssize_t ret;
+        if (s->sending == NULL)
+        {
+            s->sending = notify_pop(&s->sub);
+            s->sent = 0;
+            if (s->sending == NULL) return 0;
+        }
+
+        ret = send(s->conn.fd, s->sending->data + s->sent,
+                   s->sending->length - s->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!s->blocked) arm_deadline(&s->conn, DEADLINE_WRITE);
+            s->blocked = 1;
+            return 0;
+        }
+        if (ret <= 0) return -1;
+
+        s->sent += ret;
+        if (s->sent == s->sending->length)
+        {
+            notify_event_release(s->sending);
+            s->sending = NULL;
+            if (s->blocked) timerwheel_cancel(&timers, &s->conn.deadline);
+            s->blocked = 0;
+        }
+    }
+}
+
+/**
+ * \brief   The push thread. Adopts subscriptions handed over by handler
+ *      threads, sends their events and closes them when their clients go
+ *      away.
+ */
+void* run_pusher(void* arg)
+{
+    static struct pollfd fds[SERVER_SUBSCRIBERS + 1];
+    subscription** subs = pusher.subs;
+    size_t polled;
+    int running = 1;
+    char drain[64];
+    (void) arg;
+
+    while (running)
+    {
+        fds[0].fd = pusher.wake_fds[0];
+        fds[0].events = POLLIN;
+        polled = pusher.subs_length;
+        for (size_t i = 0; i < polled; ++i)
+        {
+            fds[i + 1].fd = subs[i]->conn.fd;
+            fds[i + 1].events = POLLIN | (subs[i]->blocked ? POLLOUT : 0);
+        }
+        if (poll(fds, polled + 1, -1) < 0)
+        {
+            if (errno != EINTR) dlog(LOG_ERROR, "Failed to poll subscribers");
+            continue;
+        }
+
+        // Subscribers don't send anything further, so a connection becoming
+        // readable means it has closed (or is misbehaving, or its deadline
+        // has expired and it has been shut down).
+        for (size_t i = 0; i < polled; ++i)
+        {
+            subs[i]->closing = (fds[i + 1].revents & ~POLLOUT) != 0;
+            subs[i]->flush = (fds[i + 1].revents & POLLOUT) != 0;
+        }
+
+        // Adopt new subscriptions and find those with events queued.
+        pthread_mutex_lock(&pusher.lock);
+        while (read(pusher.wake_fds[0], drain, sizeof(drain)) > 0) {}
+        pusher.woken = 0;
+        running = pusher.running;
+        for (size_t i = 0; i < pusher.added_length; ++i)
+            subs[pusher.subs_length++] = pusher.added[i];
+        pusher.added_length = 0;
+        for (size_t i = 0; i < pusher.subs_length; ++i)
+        {
+            if (i >= polled) subs[i]->ready = 1;
+            subs[i]->flush |= subs[i]->ready;
+            subs[i]->ready = 0;
+        }
+        pthread_mutex_unlock(&pusher.lock);
+
+        // Send events, then close failed connections.
+        for (size_t i = 0; i < pusher.subs_length; ++i)
+            if (running && !subs[i]->closing && subs[i]->flush &&
+                flush_subscription(subs[i]) < 0)
+                subs[i]->closing = 1;
+        for (size_t i = pusher.subs_length; i-- > 0;)
+        {
+            subscription* s = subs[i];
+            if (running && !s->closing) continue;
+
+            // The deadline must be cancelled first so it cannot shut down a
+            // reused descriptor.
+            timerwheel_cancel(&timers, &s->conn.deadline);
+            if (s->conn.expired)
+                dlog(LOG_WARNING, "Subscriber %s deadline expired",
+                     deadline_names[s->conn.kind]);
+            close(s->conn.fd);
+            free_subscription(s);
+            subs[i] = subs[--pusher.subs_length];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief   Starts the push thread.
+ *
+ * \return  0 on success, < 0 on error.
+ */
+int start_pusher(void)
+{
+    pusher.woken = 0;
+    pusher.running = 1;
+    pusher.count = 0;
+    pusher.added_length = 0;
+    pusher.subs_length = 0;
+    if (pthread_mutex_init(&pusher.lock, NULL) != 0) return -1;
+    if (pipe(pusher.wake_fds) < 0) return -1;
+    fcntl(pusher.wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(pusher.wake_fds[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&pusher.thread, NULL, run_pusher, NULL) != 0)
+    {
+        close(pusher.wake_fds[0]);
+        close(pusher.wake_fds[1]);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief   Stops the push thread, closing every subscription. No handler
+ *      thread may be running.
+ */
+void stop_pusher(void)
+{
+    pthread_mutex_lock(&pusher.lock);
+    pusher.running = 0;
+    if (write(pusher.wake_fds[1], "", 1) < 0)
+        dlog(LOG_WARNING, "Failed to wake push thread");
+    pthread_mutex_unlock(&pusher.lock);
+    pthread_join(pusher.thread, NULL);
+    close(pusher.wake_fds[0]);
+    close(pusher.wake_fds[1]);
+    pthread_mutex_destroy(&pusher.lock);
+}
+
+/**
+ * \brief   Subscribes a client to change events on one or more resources and
+ *      hands the connection to the push thread, which pushes each event to it
+ *      until it disconnects. Replies "ok N" with the number of resources
+ *      subscribed to, then sends one "event RESOURCE VERSION VALUE" line per
+ *      change. Each subscriber has a bounded queue holding at most one event
+ *      per resource so a slow client only ever has intermediate events
+ *      coalesced, it never delays a writer. Only sends have a deadline: a
+ *      subscriber may wait indefinitely for a resource to change. At most
+ *      SERVER_SUBSCRIBERS clients may be subscribed at once.
+ *
+ * \param conn      The client connection. Not NULL.
+ * \param names     The NUL terminated, space separated resource names.
+ *      Modified during parsing. Not NULL.
+ * \return  1 if the connection was handed to the push thread, which will
+ *      close it, 0 if it is still owned by the caller.
+ */
+int process_subscription(connection* conn, char* names)
+{
+    int client_fd = conn->fd;
+    subscription* s;
+    char buf[SERVER_PEEKLEN];
+    const char* error = NULL;
+    char* name;
+    int len;
+
+    // Claim a slot, then look up every resource before subscribing to any.
+    pthread_mutex_lock(&pusher.lock);
+    if (pusher.count == SERVER_SUBSCRIBERS) error = "err too many subscribers\n";
+    else pusher.count++;
+    pthread_mutex_unlock(&pusher.lock);
+    if (error)
+    {
+        send_all(client_fd, error, strlen(error));
+        return 0;
+    }
+    s = calloc(1, sizeof(subscription));
+    if (s == NULL || notify_subscriber_create(&s->sub) < 0)
+    {
+        dlog(LOG_ERROR, "Failed to create subscriber");
+        free(s);
+        pthread_mutex_lock(&pusher.lock);
+        pusher.count--;
+        pthread_mutex_unlock(&pusher.lock);
+        return 0;
+    }
+    s->sub.wake = wake_pusher;
+    s->sub.wake_arg = s;
+    while (error == NULL && (name = next_word(&names)) != NULL)
+    {
+        if (s->res_length == SERVER_SUBSCRIPTIONS)
+            error = "err too many resources\n";
+        else if (!resource_name_valid(name) ||
+                 (s->res[s->res_length] = resource_lookup(&resources, name)) == NULL)
+            error = "err invalid resource\n";
+        else
+            ++s->res_length;
+    }
+    // A subscription to nothing could never be sent anything.
+    if (error == NULL && s->res_length == 0)
+        error = "err no resources\n";
+    if (error)
+    {
+        send_all(client_fd, error, strlen(error));
+        free_subscription(s);
+        return 0;
+    }
+    subscribe_all(s, 1);
+    dlog(LOG_INFO, "Client subscribed to %zu resources", s->res_length);
+
+    len = snprintf(buf, SERVER_PEEKLEN, "ok %zu\n", s->res_length);
+    arm_deadline(conn, DEADLINE_WRITE);
+    if (send_all(client_fd, buf, len) < 0)
+    {
+        free_subscription(s);
+        return 0;
+    }
+
+    // Hand the connection over. Events published since subscribing are sent
+    // as soon as the push thread adopts it.
+    s->conn.fd = client_fd;
+    s->conn.expired = 0;
+    wheel_timer_init(&s->conn.deadline);
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    pthread_mutex_lock(&pusher.lock);
+    pusher.added[pusher.added_length++] = s;
+    if (!pusher.woken)
+    {
+        pusher.woken = 1;
+        if (write(pusher.wake_fds[1], "", 1) < 0)
+            dlog(LOG_WARNING, "Failed to wake push thread");
+    }
+    pthread_mutex_unlock(&pusher.lock);
+    return 1;
+}
+
 /**
  * \brief   Processes a connection with a client.
  *
- * \param client_fd File descriptor of the client to process.
+ * \param accepted_raw  The accepted_connection to process, which is freed.
  */
-void process_connection(void* client_fd_raw)
+void process_connection(void* accepted_raw)
 {
-    int client_fd = (long) client_fd_raw;
+    accepted_connection* accepted = accepted_raw;
+    int client_fd = accepted->fd;
+    uint64_t accepted_time = accepted->accepted;
     int ret;
-    char rdbuf[SERVER_BUFLEN];
-    char wrbuf[SERVER_BUFLEN];
+    connection conn;
+    char rdbuf[SERVER_REQUESTLEN];
+    char wrbuf[SERVER_REPLYLEN];
+    char request[SERVER_REQUESTLEN];
+    capture_record record;
+    char* eol;
+    char* cmd;
+    threadpool_priority priority;
+    unsigned long deadline_ms;
+
+    free(accepted);
+    conn.fd = client_fd;
+    conn.expired = 0;
+    wheel_timer_init(&conn.deadline);
 
     // Read the command.
-    while ((ret = read(client_fd, rdbuf, SERVER_BUFLEN)) == 0) {}
-    if (ret <= 0)
+    arm_deadline(&conn, DEADLINE_READ);
+    ret = read_request(client_fd, rdbuf, SERVER_REQUESTLEN);
+    if (ret == -2)
+    {
+        dlog(LOG_WARNING, "Client request too long");
+        snprintf(wrbuf, SERVER_REPLYLEN, "err request too long");
+        arm_deadline(&conn, DEADLINE_WRITE);
+        send_all(client_fd, wrbuf, strlen(wrbuf));
+        goto exit;
+    }
+    if (ret == 0)
+    {
+        dlog(LOG_WARNING, "Client connection closed without a command");
+        goto exit;
+    }
+    if (ret < 0)
     {
         dlog(LOG_WARNING, "Failed to read from client connection");
         goto exit;
     }
+    // Keep the request as read to capture it once the reply has been sent
+    // (processing modifies rdbuf). It is timed from being accepted, so the
+    // latency includes waiting for a handler thread and reading the request.
+    if (capture.fd >= 0)
+    {
+        record.timestamp = accepted_time;
+        record.length = ret;
+        memcpy(request, rdbuf, ret);
+    }
+    cmd = parse_schedule(rdbuf, &priority, &deadline_ms);
 
-    // Perform the command.
-    if (strncmp(rdbuf, "print", SERVER_BUFLEN) == 0)
+    // Perform the command. A batch's first line is "batch [atomic]" and each
+    // following line is one command. A subscription keeps the connection (and
+    // is not captured, as it has no single reply to time).
+    eol = strpbrk(cmd, "\r\n");
+    if (starts_with_verb(cmd, "subscribe"))
     {
-        snprintf(wrbuf, SERVER_BUFLEN, "%s", "hello world");
-        ret = write(client_fd, wrbuf, strnlen(wrbuf, SERVER_BUFLEN));
-        if (ret <= 0)
+        if (eol) *eol = '\0';
+        if (process_subscription(&conn, cmd + 9) > 0)
         {
-            dlog(LOG_WARNING, "Failed to write to client connection");
-            goto exit;
+            // The push thread now owns the connection.
+            timerwheel_cancel(&timers, &conn.deadline);
+            return;
         }
+        goto exit;
+    }
+    else if (starts_with_verb(cmd, "batch"))
+    {
+        int atomic = 0;
+        if (eol) *eol++ = '\0';
+        cmd += 5;
+        while (*cmd == ' ') ++cmd;
+        if (strcmp(cmd, "atomic") == 0) atomic = 1;
+        else if (*cmd != '\0') atomic = -1;
+        if (atomic < 0)
+            snprintf(wrbuf, SERVER_REPLYLEN, "err unknown batch mode");
+        ret = atomic < 0 ? -1 : perform_batch(eol ? eol : "", atomic, wrbuf,
+                                              SERVER_REPLYLEN);
     }
     else
     {
-        rdbuf[SERVER_BUFLEN-1] = '\0';
-        dlog(LOG_WARNING, "Unknown command from client: %s", rdbuf);
+        if (eol) *eol = '\0';
+        ret = perform_command(cmd, wrbuf, SERVER_OPREPLYLEN);
+    }
+    if (ret < 0)
+        dlog(LOG_WARNING, "Failed command from client: %s", wrbuf);
+    arm_deadline(&conn, DEADLINE_WRITE);
+    ret = send_all(client_fd, wrbuf, strnlen(wrbuf, SERVER_REPLYLEN));
+    if (ret < 0)
+    {
+        dlog(LOG_WARNING, "Failed to write to client connection");
+        goto exit;
+    }
+    if (capture.fd >= 0)
+    {
+        record.latency = latency_now() - record.timestamp;
+        if (capture_append(&capture, &record, request) < 0)
+            dlog(LOG_WARNING, "Failed to capture request");
     }
 
 exit:
-    // Done with the connection, close it.
+    // Done with the connection, close it. The deadline must be cancelled
+    // first so it cannot shut down a reused descriptor.
+    timerwheel_cancel(&timers, &conn.deadline);
+    if (conn.expired)
+        dlog(LOG_WARNING, "Client connection %s deadline expired",
+             deadline_names[conn.kind]);
     close(client_fd);
 }
 
+/**
+ * \brief   Dispatches an accepted connection to a handler thread, scheduled
+ *      according to its request's scheduling header. The header is peeked at
+ *      without being consumed, so the connection must only be dispatched once
+ *      its request has started to arrive.
+ *
+ * \param accepted  The accepted connection. Ownership passes to the handler
+ *      thread, or it is closed and freed if it can't be dispatched.
+ * \return  0 on success, -1 if none of the request has arrived yet, in which
+ *      case the caller still owns the connection.
+ */
+int dispatch_connection(accepted_connection* accepted)
+{
+    char peekbuf[SERVER_PEEKLEN];
+    threadpool_priority priority;
+    unsigned long deadline_ms;
+    uint64_t deadline;
+    int ret;
+
+    ret = recv(accepted->fd, peekbuf, SERVER_PEEKLEN - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -1;
+
+    // A connection which has closed or failed is dispatched as normal
+    // priority and the handler thread reports it.
+    peekbuf[ret > 0 ? ret : 0] = '\0';
+    parse_schedule(peekbuf, &priority, &deadline_ms);
+    deadline = deadline_ms ? accepted->accepted + deadline_ms * 1000000ull : 0;
+
+    // Spawn a thread to process the connection. The spawned thread is
+    // responsible for closing the client_fd and freeing accepted.
+    dlog(LOG_INFO, "Accepted %s priority client connection, dispatching handler",
+         priority_names[priority]);
+    if (threadpool_dispatch_sched(&pool, process_connection, accepted, priority,
+                                  deadline) < 0)
+    {
+        dlog(LOG_ERROR, "Failed to dispatch client connection");
+        close(accepted->fd);
+        free(accepted);
+    }
+    return 0;
+}
+
 /**
  * \brief   Waits and processes incoming connections to the server until an
  *      inactivity timeout has been reached, at which point it exits.
  *
+ *      A connection is only dispatched once its request has started to arrive
+ *      so it can be scheduled by the request's header. Until then it is
+ *      parked and polled alongside the server, for up to SERVER_READ_TIMEOUT.
+ *
  * \param server_fd File descriptor of the server to accept from.
  */
 void process_connections(int server_fd)
 {
-    int ret, client_fd;
-    threadpool pool;
-    struct pollfd server_poll;
-    server_poll.fd = server_fd;
-    server_poll.events = POLLIN;
+    int ret, client_fd, timeout;
+    accepted_connection* accepted;
+    accepted_connection* parked[SERVER_PARKED];
+    size_t parked_length = 0;
+    uint64_t now, expires;
+    char stats[SERVER_OPREPLYLEN];
+    struct pollfd polls[SERVER_PARKED + 1];
 
-    if (threadpool_create(&pool, SERVER_THREADS) < 0)
+    if (timerwheel_create(&timers, SERVER_TICK_MS) < 0)
+    {
+        dlog(LOG_ERROR, "Failed to create timer wheel");
+        return;
+    }
+    if (threadpool_create_elastic(&pool, SERVER_THREADS_MIN, SERVER_THREADS_MAX,
+                                  SERVER_THREAD_STACK) < 0)
     {
         dlog(LOG_ERROR, "Failed to create threadpool");
+        timerwheel_destroy(&timers);
+        return;
+    }
+    if (start_pusher() < 0)
+    {
+        dlog(LOG_ERROR, "Failed to start push thread");
+        threadpool_destroy(&pool);
+        timerwheel_destroy(&timers);
         return;
     }
 
     for (;;)
     {
-        // Wait for a connection with a timeout.
-        ret = poll(&server_poll, 1, SERVER_TIMEOUT);
-        if (ret <= 0)
+        // Wait for a connection, or for a parked connection's request, with a
+        // timeout. New connections are left in the listen queue while the
+        // parked connections are full.
+        polls[0].fd = server_fd;
+        polls[0].events = parked_length < SERVER_PARKED ? POLLIN : 0;
+        timeout = SERVER_TIMEOUT;
+        now = latency_now();
+        for (size_t i = 0; i < parked_length; ++i)
+        {
+            polls[i + 1].fd = parked[i]->fd;
+            polls[i + 1].events = POLLIN;
+            expires = parked[i]->accepted + SERVER_READ_TIMEOUT * 1000000ull;
+            if (expires <= now) timeout = 0;
+            else if ((expires - now) / 1000000 + 1 < (uint64_t) timeout)
+                timeout = (expires - now) / 1000000 + 1;
+        }
+        ret = poll(polls, parked_length + 1, timeout);
+        if (ret < 0 && errno != EINTR)
+            dlog(LOG_ERROR, "Failed to poll for connections");
+        if (ret <= 0 && parked_length == 0)
         {
-            // Timed out, are there active threads?
+            // Timed out, are there active threads or subscribers?
             ret = threadpool_active_threads(&pool);
             if (ret < 0)
             {
                 dlog(LOG_WARNING, "Failed to count threadpool active threads");
             }
+            else if (ret == 0 && count_subscriptions() > 0)
+            {
+                dlog(LOG_INFO, "No new connections but %zu subscribers",
+                     count_subscriptions());
+            }
             else if (ret == 0)
             {
                 dlog(LOG_INFO, "Daemon activity timeout reached");
@@ -253,6 +1469,30 @@ void process_connections(int server_fd)
             continue;
         }
 
+        // Dispatch the parked connections whose requests have arrived, and
+        // close those which have waited too long, as their handler would.
+        now = latency_now();
+        for (size_t i = parked_length; i-- > 0;)
+        {
+            accepted = parked[i];
+            if (ret > 0 && polls[i + 1].revents && dispatch_connection(accepted) == 0)
+            {
+                parked[i] = parked[--parked_length];
+            }
+            else if (now >= accepted->accepted + SERVER_READ_TIMEOUT * 1000000ull)
+            {
+                __atomic_add_fetch(&connections_expired[DEADLINE_READ], 1,
+                                   __ATOMIC_RELAXED);
+                dlog(LOG_WARNING, "Client connection %s deadline expired",
+                     deadline_names[DEADLINE_READ]);
+                close(accepted->fd);
+                free(accepted);
+                parked[i] = parked[--parked_length];
+            }
+        }
+        if (ret <= 0 || !(polls[0].revents & POLLIN))
+            continue;
+
         // Connection must be ready, accept it.
         client_fd = accept(server_fd, NULL, NULL);
         if (client_fd < 0)
@@ -260,15 +1500,28 @@ void process_connections(int server_fd)
             dlog(LOG_ERROR, "Failed to accept client connection");
             continue;
         }
+        accepted = malloc(sizeof(*accepted));
+        if (accepted == NULL)
+        {
+            dlog(LOG_ERROR, "Failed to allocate client connection");
+            close(client_fd);
+            continue;
+        }
+        accepted->fd = client_fd;
+        accepted->accepted = latency_now();
 
-        // Spawn a thread to process the connection. The spawned thread is
-        // responsible for closing the client_fd.
-        dlog(LOG_INFO, "Accepted client connection, spawning handler thread");
-        ret = threadpool_dispatch(&pool, process_connection, (void*)((long) client_fd));
+        // Clients usually send their request straight after connecting, so it
+        // has often arrived already.
+        if (dispatch_connection(accepted) < 0)
+            parked[parked_length++] = accepted;
     }
 
+    format_stats(stats, SERVER_OPREPLYLEN);
+    dlog(LOG_INFO, "Scheduling statistics: %s", stats);
     dlog(LOG_INFO, "Processing finished, exiting");
     threadpool_destroy(&pool);
+    stop_pusher();
+    timerwheel_destroy(&timers);
 }
 
 /**
@@ -287,21 +1540,37 @@ int main(int argc, char* const argv[])
     // Attempt to acquire lock to ensure daemon is mutually exclusive.
     flock daemon_lock;
     daemon_lock.glob_fp = LOCK_FILE;
-    if (acquire_flock(&daemon_lock) < 0)
+    while (acquire_flock(&daemon_lock) < 0)
     {
         // Daemon is already running. Wait for it to finish initialising (if it
         // still is) and return.
         dlog(LOG_INFO, "Daemon already running, awaiting initialisation...");
-        await_flock_post(flock_msg, FLOCK_POST_LEN, &daemon_lock);
-        dlog(LOG_INFO, "Daemon up on port %s", flock_msg);
-        printf("%s\n", flock_msg);
-        return 0;
+        if (await_flock_post(flock_msg, FLOCK_POST_LEN, &daemon_lock) == 0)
+        {
+            dlog(LOG_INFO, "Daemon up on port %s", flock_msg);
+            printf("%s\n", flock_msg);
+            return 0;
+        }
+
+        // The daemon exited or died before we could connect to it, try to
+        // take over.
+        dlog(LOG_WARNING, "Daemon is no longer running, retrying...");
     }
     dlog(LOG_INFO, "No daemon running, lock acquired, initialising...");
 
     // Do any initial setup before unblocking the parent process.
     listen_fd = init();
     get_port(port_s, listen_fd);
+    if (resource_table_create(&resources, SERVER_SHARDS) < 0)
+        DIE("Failed to create resource table");
+    if (program_opts.capture_file)
+    {
+        if (capture_open(&capture, program_opts.capture_file) < 0)
+            dlog(LOG_ERROR, "Failed to open capture file %s, not capturing",
+                 program_opts.capture_file);
+        else
+            dlog(LOG_INFO, "Capturing requests to %s", program_opts.capture_file);
+    }
 
     // Advertise the process so the caller can find it.
     post_to_flock(&daemon_lock, port_s);
@@ -309,10 +1578,12 @@ int main(int argc, char* const argv[])
     printf("%s\n", port_s);
 
     // Background the process to unblock the caller.
-    daemonize();
+    daemonize(&daemon_lock);
 
     // Enter main processing loop.
     process_connections(listen_fd);
+    resource_table_destroy(&resources);
+    capture_close(&capture);
 
     // Daemon finished, release lock and return.
     release_flock(&daemon_lock);
@@ -0,0 +1,800 @@
+/**
+ * \file   bench.c
+ * \author Jonathan Simmonds
+ * \brief  Microbenchmarks for the primitives the acquisition daemon is built
+ *      from: the threadpool, the file lock, the logger and the timer wheel.
+ */
+#include <assert.h>     // assert
+#include <errno.h>      // errno, EINTR
+#include <inttypes.h>   // PRIu64, SCNu64
+#include <pthread.h>    // pthread_create, pthread_join
+#include <sched.h>      // sched_yield
+#include <stdint.h>     // uint64_t
+#include <stdio.h>      // printf, snprintf
+#include <stdlib.h>     // malloc, free, strtoul
+#include <string.h>     // strcmp, strtok
+#include <sys/mman.h>   // mmap, munmap
+#include <sys/wait.h>   // waitpid
+#include <unistd.h>     // fork, getopt, getpid, usleep, _exit
+
+#include "flock.h"
+#include "latency.h"
+#include "log.h"
+#include "threadpool.h"
+#include "timerwheel.h"
+
+
+
+/*
+ * Defines
+ */
+
+#define DEFAULT_ITERATIONS  10000
+#define DEFAULT_THREADS     "1,4,16"
+#define MAX_THREAD_COUNTS   16
+#define BENCH_LOCK_FILE     "/tmp/.acquired-bench.%d.lck"
+#define BENCH_LOG_FILE      "/tmp/.acquired-bench.%d.log"
+#define FLOCK_POST_LEN      128
+// Each flock_wake round forks its waiters, so it runs far fewer rounds than
+// the other benchmarks run operations.
+#define WAKE_ROUND_DIVISOR  100
+#define WAKE_MIN_ROUNDS     10
+#define WAKE_SETTLE_US      2000
+// Each flock_recovery round also forks an owner and waits for it to die.
+#define RECOVERY_ROUND_DIVISOR 500
+#define RECOVERY_MIN_ROUNDS 10
+#define WHEEL_TICK_MS       10
+#define WHEEL_TIMERS        1024
+
+
+
+/*
+ * Structs
+ */
+
+typedef enum bench_format_t
+{
+    FORMAT_CSV,
+    FORMAT_JSON,
+} bench_format;
+
+typedef struct cl_opts_t
+{
+    bench_format format;
+    size_t       iterations;
+    size_t       threads[MAX_THREAD_COUNTS];
+    size_t       threads_length;
+    char* const* benchmarks;
+    int          benchmarks_length;
+} cl_opts;
+
+/**
+ * \brief   Result of a single benchmark run.
+ */
+typedef struct bench_result_t
+{
+    /** Number of timed operations. */
+    size_t   ops;
+    /** Wall time for the whole run, in nanoseconds. */
+    uint64_t elapsed;
+    /** Per-operation samples, in nanoseconds. ops entries long. */
+    uint64_t* samples;
+} bench_result;
+
+typedef int (*bench_fn)(bench_result* result, size_t threads,
+                        size_t iterations);
+
+typedef struct benchmark_t
+{
+    const char* name;
+    const char* description;
+    bench_fn    run;
+} benchmark;
+
+struct dispatch_arg_t
+{
+    uint64_t  dispatched;
+    uint64_t* sample;
+    /** Set once the routine has run. */
+    volatile int done;
+};
+
+/**
+ * \brief   State shared between the processes of a flock_recovery round.
+ */
+struct recovery_state_t
+{
+    /** Set by the owner once it holds the lock. */
+    volatile int     owned;
+    /** Set by the parent to tell the owner to die. */
+    volatile int     kill;
+    /** Time the owner died. */
+    volatile uint64_t died;
+    /** Time the first contender took over the lock. */
+    volatile uint64_t recovered;
+    /** Number of contenders which have seen the lock taken over. */
+    volatile int     losers;
+};
+
+struct dlog_arg_t
+{
+    size_t    ops;
+    uint64_t* samples;
+};
+
+struct wheel_arg_t
+{
+    timerwheel* wheel;
+    size_t      ops;
+    uint64_t*   samples;
+};
+
+
+
+/*
+ * Globals
+ */
+
+extern char *optarg;    // getopt
+extern int optind;      // getopt
+extern const char* log_file;    // log
+cl_opts program_opts;
+
+
+
+/*
+ * Helpers
+ */
+
+/**
+ * \brief   Allocates a sample array which is shared with forked children.
+ *
+ * \param length    Number of samples.
+ * \return  Pointer to the shared array. Never NULL.
+ */
+static uint64_t* shared_samples(size_t length)
+{
+    void* mem = mmap(NULL, sizeof(uint64_t) * length, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) DIE("Failed to map shared sample buffer");
+    return mem;
+}
+
+/**
+ * \brief   Waits for every forked child to exit, dying if any failed.
+ */
+static void reap_children(pid_t* children, size_t length)
+{
+    int status;
+    for (size_t i = 0; i < length; ++i)
+    {
+        while (waitpid(children[i], &status, 0) < 0)
+            if (errno != EINTR) DIE("Failed to wait for child");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            DIE("Benchmark child %d failed", (int) children[i]);
+    }
+}
+
+
+
+/*
+ * Benchmarks
+ */
+
+static void dispatch_routine(void* arg_raw)
+{
+    struct dispatch_arg_t* arg = arg_raw;
+    *arg->sample = latency_now() - arg->dispatched;
+    __atomic_store_n(&arg->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief   Measures the time from threadpool_dispatch being called to the
+ *      routine starting on an idle worker thread of an N thread pool. Each
+ *      routine is waited for before the next is dispatched, so no routine
+ *      queues behind another.
+ */
+static int bench_threadpool_dispatch(bench_result* result, size_t threads,
+                                     size_t iterations)
+{
+    threadpool pool;
+    struct dispatch_arg_t arg;
+    uint64_t start;
+
+    result->samples = malloc(sizeof(uint64_t) * iterations);
+    if (!result->samples) return -1;
+    if (threadpool_create(&pool, threads) < 0) return -1;
+
+    start = latency_now();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        arg.sample = &result->samples[i];
+        arg.done = 0;
+        arg.dispatched = latency_now();
+        if (threadpool_dispatch(&pool, dispatch_routine, &arg) != 0)
+            return -1;
+        while (!__atomic_load_n(&arg.done, __ATOMIC_ACQUIRE))
+            sched_yield();
+    }
+    result->elapsed = latency_now() - start;
+    result->ops = iterations;
+
+    threadpool_destroy(&pool);
+    return 0;
+}
+
+/**
+ * \brief   Measures the time from threadpool_dispatch being called to the
+ *      routine starting when every routine is dispatched back to back to an N
+ *      thread pool, i.e. how long routines wait for the queue to drain.
+ */
+static int bench_threadpool_drain(bench_result* result, size_t threads,
+                                  size_t iterations)
+{
+    threadpool pool;
+    struct dispatch_arg_t* args;
+    uint64_t start;
+
+    args = malloc(sizeof(*args) * iterations);
+    result->samples = malloc(sizeof(uint64_t) * iterations);
+    if (!args || !result->samples) return -1;
+    if (threadpool_create(&pool, threads) < 0) return -1;
+
+    start = latency_now();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        args[i].sample = &result->samples[i];
+        args[i].dispatched = latency_now();
+        if (threadpool_dispatch(&pool, dispatch_routine, &args[i]) != 0)
+            return -1;
+    }
+    while (threadpool_active_threads(&pool) > 0)
+        sched_yield();
+    result->elapsed = latency_now() - start;
+    result->ops = iterations;
+
+    threadpool_destroy(&pool);
+    free(args);
+    return 0;
+}
+
+/**
+ * \brief   Measures the time for each of N processes to acquire (and then
+ *      release) a single contended file lock.
+ */
+static int bench_flock_contention(bench_result* result, size_t threads,
+                                  size_t iterations)
+{
+    char lock_fp[MAXPATH];
+    size_t per_child = iterations / threads;
+    pid_t children[threads];
+    uint64_t* samples;
+    uint64_t start;
+
+    if (per_child == 0) per_child = 1;
+    snprintf(lock_fp, MAXPATH, BENCH_LOCK_FILE, (int) getpid());
+    samples = shared_samples(per_child * threads);
+
+    start = latency_now();
+    for (size_t c = 0; c < threads; ++c)
+    {
+        children[c] = fork();
+        if (children[c] < 0) DIE("Failed to fork");
+        if (children[c] == 0)
+        {
+            flock lock;
+            lock.glob_fp = lock_fp;
+            for (size_t i = 0; i < per_child; ++i)
+            {
+                uint64_t t0 = latency_now();
+                while (acquire_flock(&lock) < 0)
+                    sched_yield();
+                samples[c * per_child + i] = latency_now() - t0;
+                release_flock(&lock);
+            }
+            _exit(0);
+        }
+    }
+    reap_children(children, threads);
+    result->elapsed = latency_now() - start;
+    result->ops = per_child * threads;
+
+    result->samples = malloc(sizeof(uint64_t) * result->ops);
+    if (!result->samples) return -1;
+    memcpy(result->samples, samples, sizeof(uint64_t) * result->ops);
+    munmap(samples, sizeof(uint64_t) * result->ops);
+    return 0;
+}
+
+/**
+ * \brief   Measures the time from post_to_flock being called to each of N
+ *      waiting processes returning from await_flock_post.
+ */
+static int bench_flock_wake(bench_result* result, size_t threads,
+                            size_t iterations)
+{
+    char lock_fp[MAXPATH];
+    char msg[FLOCK_POST_LEN];
+    size_t rounds = iterations / WAKE_ROUND_DIVISOR;
+    pid_t children[threads];
+    uint64_t* samples;
+    uint64_t start;
+
+    if (rounds < WAKE_MIN_ROUNDS) rounds = WAKE_MIN_ROUNDS;
+    snprintf(lock_fp, MAXPATH, BENCH_LOCK_FILE, (int) getpid());
+    samples = shared_samples(rounds * threads);
+
+    start = latency_now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        flock lock;
+        lock.glob_fp = lock_fp;
+        if (acquire_flock(&lock) < 0) DIE("Benchmark lock file already held");
+
+        for (size_t c = 0; c < threads; ++c)
+        {
+            children[c] = fork();
+            if (children[c] < 0) DIE("Failed to fork");
+            if (children[c] == 0)
+            {
+                flock waiter;
+                uint64_t posted;
+                waiter.glob_fp = lock_fp;
+                await_flock_post(msg, FLOCK_POST_LEN, &waiter);
+                if (sscanf(msg, "%" SCNu64, &posted) != 1) _exit(1);
+                samples[r * threads + c] = latency_now() - posted;
+                _exit(0);
+            }
+        }
+
+        // Give the waiters a chance to block before posting.
+        usleep(WAKE_SETTLE_US);
+        snprintf(msg, FLOCK_POST_LEN, "%" PRIu64, latency_now());
+        post_to_flock(&lock, msg);
+        reap_children(children, threads);
+        release_flock(&lock);
+    }
+    result->elapsed = latency_now() - start;
+    result->ops = rounds * threads;
+
+    result->samples = malloc(sizeof(uint64_t) * result->ops);
+    if (!result->samples) return -1;
+    memcpy(result->samples, samples, sizeof(uint64_t) * result->ops);
+    munmap(samples, sizeof(uint64_t) * result->ops);
+    return 0;
+}
+
+/**
+ * \brief   Contends for a lock whose owner is about to die, as the acquired
+ *      front-end does. The first to take it over records the time, the rest
+ *      wait for it to post and then exit.
+ */
+static void recovery_contender(const char* lock_fp, struct recovery_state_t* state,
+                               size_t contenders)
+{
+    char msg[FLOCK_POST_LEN];
+    flock lock;
+    lock.glob_fp = lock_fp;
+
+    while (acquire_flock(&lock) < 0)
+    {
+        if (await_flock_post(msg, FLOCK_POST_LEN, &lock) == 0)
+        {
+            __atomic_add_fetch(&state->losers, 1, __ATOMIC_SEQ_CST);
+            _exit(0);
+        }
+    }
+    state->recovered = latency_now();
+    post_to_flock(&lock, "recovered");
+    while (__atomic_load_n(&state->losers, __ATOMIC_SEQ_CST) < contenders - 1)
+        sched_yield();
+    release_flock(&lock);
+    _exit(0);
+}
+
+/**
+ * \brief   Measures the time from a lock owner dying without releasing the
+ *      lock (as a crashed daemon would) to one of N contending processes
+ *      taking the lock over.
+ */
+static int bench_flock_recovery(bench_result* result, size_t threads,
+                                size_t iterations)
+{
+    char lock_fp[MAXPATH];
+    char break_fp[MAXPATH + 8];
+    pid_t children[threads];
+    pid_t owner;
+    struct recovery_state_t* state;
+    size_t rounds = iterations / RECOVERY_ROUND_DIVISOR;
+    uint64_t start;
+
+    if (rounds < RECOVERY_MIN_ROUNDS) rounds = RECOVERY_MIN_ROUNDS;
+    snprintf(lock_fp, MAXPATH, BENCH_LOCK_FILE, (int) getpid());
+    state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) DIE("Failed to map shared recovery state");
+    result->ops = rounds;
+    result->samples = malloc(sizeof(uint64_t) * result->ops);
+    if (!result->samples) return -1;
+
+    start = latency_now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        memset((void*) state, 0, sizeof(*state));
+
+        // Start an owner which takes the lock and never releases it.
+        owner = fork();
+        if (owner < 0) DIE("Failed to fork");
+        if (owner == 0)
+        {
+            flock lock;
+            lock.glob_fp = lock_fp;
+            if (acquire_flock(&lock) < 0) _exit(1);
+            state->owned = 1;
+            while (!state->kill)
+                sched_yield();
+            state->died = latency_now();
+            _exit(0);
+        }
+        while (!state->owned)
+            sched_yield();
+
+        // Start the contenders, give them a chance to block, then kill the
+        // owner.
+        for (size_t c = 0; c < threads; ++c)
+        {
+            children[c] = fork();
+            if (children[c] < 0) DIE("Failed to fork");
+            if (children[c] == 0)
+                recovery_contender(lock_fp, state, threads);
+        }
+        usleep(WAKE_SETTLE_US);
+        state->kill = 1;
+        reap_children(&owner, 1);
+        reap_children(children, threads);
+        result->samples[r] = state->recovered - state->died;
+    }
+    result->elapsed = latency_now() - start;
+
+    // Breaking the stale locks leaves a break file behind.
+    snprintf(break_fp, sizeof(break_fp), "%s.break", lock_fp);
+    remove(break_fp);
+    munmap(state, sizeof(*state));
+    return 0;
+}
+
+static void* dlog_routine(void* arg_raw)
+{
+    struct dlog_arg_t* arg = arg_raw;
+    for (size_t i = 0; i < arg->ops; ++i)
+    {
+        uint64_t t0 = latency_now();
+        dlog(LOG_INFO, "Benchmark message %zu", i);
+        arg->samples[i] = latency_now() - t0;
+    }
+    return NULL;
+}
+
+/**
+ * \brief   Measures the cost of a dlog call with N threads logging to the same
+ *      file.
+ */
+static int bench_dlog(bench_result* result, size_t threads, size_t iterations)
+{
+    char log_fp[MAXPATH];
+    size_t per_thread = iterations / threads;
+    pthread_t workers[threads];
+    struct dlog_arg_t args[threads];
+    uint64_t start;
+
+    if (per_thread == 0) per_thread = 1;
+    result->ops = per_thread * threads;
+    result->samples = malloc(sizeof(uint64_t) * result->ops);
+    if (!result->samples) return -1;
+
+    snprintf(log_fp, MAXPATH, BENCH_LOG_FILE, (int) getpid());
+    log_file = log_fp;
+
+    start = latency_now();
+    for (size_t t = 0; t < threads; ++t)
+    {
+        args[t].ops = per_thread;
+        args[t].samples = &result->samples[t * per_thread];
+        if (pthread_create(&workers[t], NULL, dlog_routine, &args[t]) != 0)
+            return -1;
+    }
+    for (size_t t = 0; t < threads; ++t)
+        pthread_join(workers[t], NULL);
+    result->elapsed = latency_now() - start;
+
+    log_file = NULL;
+    remove(log_fp);
+    return 0;
+}
+
+static void noop_callback(void* arg)
+{
+    (void) arg;
+}
+
+static void* wheel_routine(void* arg_raw)
+{
+    struct wheel_arg_t* arg = arg_raw;
+    wheel_timer timers[WHEEL_TIMERS];
+
+    // Keep WHEEL_TIMERS timers armed, spread over the wheel's levels, and
+    // time re-arming (as a connection does between read and write) and
+    // cancelling each in turn.
+    for (size_t i = 0; i < WHEEL_TIMERS; ++i)
+    {
+        wheel_timer_init(&timers[i]);
+        timerwheel_arm(arg->wheel, &timers[i], 1000 + i * 100, noop_callback,
+                       NULL);
+    }
+    for (size_t i = 0; i < arg->ops; ++i)
+    {
+        wheel_timer* timer = &timers[i % WHEEL_TIMERS];
+        uint64_t t0 = latency_now();
+        timerwheel_arm(arg->wheel, timer, 5000, noop_callback, NULL);
+        timerwheel_cancel(arg->wheel, timer);
+        arg->samples[i] = latency_now() - t0;
+        timerwheel_arm(arg->wheel, timer, 1000 + i % 60000, noop_callback,
+                       NULL);
+    }
+    for (size_t i = 0; i < WHEEL_TIMERS; ++i)
+        timerwheel_cancel(arg->wheel, &timers[i]);
+    return NULL;
+}
+
+/**
+ * \brief   Measures the cost of arming and then cancelling a timer with N
+ *      threads sharing a timer wheel which already holds many timers.
+ */
+static int bench_timerwheel(bench_result* result, size_t threads,
+                            size_t iterations)
+{
+    timerwheel wheel;
+    size_t per_thread = iterations / threads;
+    pthread_t workers[threads];
+    struct wheel_arg_t args[threads];
+    uint64_t start;
+
+    if (per_thread == 0) per_thread = 1;
+    result->ops = per_thread * threads;
+    result->samples = malloc(sizeof(uint64_t) * result->ops);
+    if (!result->samples) return -1;
+    if (timerwheel_create(&wheel, WHEEL_TICK_MS) < 0) return -1;
+
+    start = latency_now();
+    for (size_t t = 0; t < threads; ++t)
+    {
+        args[t].wheel = &wheel;
+        args[t].ops = per_thread;
+        args[t].samples = &result->samples[t * per_thread];
+        if (pthread_create(&workers[t], NULL, wheel_routine, &args[t]) != 0)
+            return -1;
+    }
+    for (size_t t = 0; t < threads; ++t)
+        pthread_join(workers[t], NULL);
+    result->elapsed = latency_now() - start;
+
+    timerwheel_destroy(&wheel);
+    return 0;
+}
+
+static const benchmark benchmarks[] =
+{
+    { "threadpool_dispatch", "dispatch call to routine start, one at a time",
+      bench_threadpool_dispatch },
+    { "threadpool_drain",    "dispatch call to routine start, back to back",
+      bench_threadpool_drain },
+    { "flock_contention",    "acquire_flock under N contending processes",
+      bench_flock_contention },
+    { "flock_wake",          "post_to_flock to await_flock_post return",
+      bench_flock_wake },
+    { "flock_recovery",      "lock owner death to takeover by N contenders",
+      bench_flock_recovery },
+    { "dlog",                "dlog call with N logging threads",
+      bench_dlog },
+    { "timerwheel",          "timer arm and cancel with N arming threads",
+      bench_timerwheel },
+};
+#define BENCHMARKS_LENGTH (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+
+
+/*
+ * Output
+ */
+
+static void print_header(bench_format format)
+{
+    if (format == FORMAT_CSV)
+        printf("benchmark,threads,ops,ns_per_op,mean_ns,min_ns,p50_ns,p90_ns,"
+               "p99_ns,p999_ns,max_ns\n");
+    else
+        printf("[\n");
+}
+
+static void print_result(bench_format format, int first, const char* name,
+                         size_t threads, const bench_result* result,
+                         const latency_summary* s)
+{
+    uint64_t ns_per_op = result->ops ? result->elapsed / result->ops : 0;
+    if (format == FORMAT_CSV)
+    {
+        printf("%s,%zu,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+               ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               name, threads, result->ops, ns_per_op, s->mean, s->min, s->p50,
+               s->p90, s->p99, s->p999, s->max);
+    }
+    else
+    {
+        printf("%s  {\"benchmark\": \"%s\", \"threads\": %zu, \"ops\": %zu, "
+               "\"ns_per_op\": %" PRIu64 ", \"mean_ns\": %" PRIu64
+               ", \"min_ns\": %" PRIu64 ", \"p50_ns\": %" PRIu64
+               ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+               ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}",
+               first ? "" : ",\n", name, threads, result->ops, ns_per_op,
+               s->mean, s->min, s->p50, s->p90, s->p99, s->p999, s->max);
+    }
+    fflush(stdout);
+}
+
+static void print_footer(bench_format format, int empty)
+{
+    if (format == FORMAT_JSON)
+        printf("%s]\n", empty ? "" : "\n");
+}
+
+
+
+/*
+ * Functions
+ */
+
+/**
+ * \brief   Prints the program help text.
+ */
+void print_help(void)
+{
+    printf("Usage: bench [-h] [-f FORMAT] [-n ITERATIONS] [-t THREADS] "
+           "[BENCHMARK ...]\n");
+    printf("\n");
+    printf("Runs microbenchmarks of the acquisition daemon's primitives and\n");
+    printf("prints per-operation latencies in nanoseconds.\n");
+    printf("\n");
+    printf("Positional arguments:\n");
+    printf("  BENCHMARK  Benchmark to run. Defaults to all of:\n");
+    for (size_t i = 0; i < BENCHMARKS_LENGTH; ++i)
+        printf("               %-20s %s\n", benchmarks[i].name,
+               benchmarks[i].description);
+    printf("\n");
+    printf("Optional arguments:\n");
+    printf("  -h    Show this help message and exit.\n");
+    printf("  -f    Output format, 'csv' (default) or 'json'.\n");
+    printf("  -n    Operations per run (default %d).\n", DEFAULT_ITERATIONS);
+    printf("  -t    Comma separated thread (or process) counts to run each\n");
+    printf("        benchmark at (default %s).\n", DEFAULT_THREADS);
+}
+
+/**
+ * \brief   Parses a comma separated list of thread counts.
+ */
+static void parse_threads(cl_opts* opts, const char* arg)
+{
+    char buf[256];
+    char* save = NULL;
+    snprintf(buf, sizeof(buf), "%s", arg);
+
+    opts->threads_length = 0;
+    for (char* tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        unsigned long n = strtoul(tok, NULL, 10);
+        if (n == 0 || opts->threads_length >= MAX_THREAD_COUNTS)
+        {
+            print_help();
+            exit(1);
+        }
+        opts->threads[opts->threads_length++] = n;
+    }
+}
+
+/**
+ * \brief   Parses the command line arguments.
+ *
+ * \param opts  Pointer to the cl_opts structure to populate with arguments.
+ * \param argc  The number of passed arguments.
+ * \param argv  The passed argument array.
+ */
+void parse_command_line(cl_opts* opts, int argc, char* const argv[])
+{
+    int opt;
+    assert(opts);
+
+    // Set defaults.
+    opts->format = FORMAT_CSV;
+    opts->iterations = DEFAULT_ITERATIONS;
+    parse_threads(opts, DEFAULT_THREADS);
+
+    // Parse optional arguments.
+    while ((opt = getopt(argc, argv, "hf:n:t:")) >= 0)
+    {
+        switch (opt)
+        {
+            case 'f':
+                if (strcmp(optarg, "csv") == 0) opts->format = FORMAT_CSV;
+                else if (strcmp(optarg, "json") == 0) opts->format = FORMAT_JSON;
+                else { print_help(); exit(1); }
+                break;
+            case 'n': opts->iterations = strtoul(optarg, NULL, 10); break;
+            case 't': parse_threads(opts, optarg); break;
+            case 'h': print_help(); exit(0); break;
+            default:  print_help(); exit(1); break;
+        }
+    }
+    if (opts->iterations == 0) { print_help(); exit(1); }
+
+    // Parse positional arguments.
+    opts->benchmarks = &argv[optind];
+    opts->benchmarks_length = argc - optind;
+}
+
+/**
+ * \brief   Determines whether a benchmark was selected on the command line.
+ */
+static int selected(const cl_opts* opts, const char* name)
+{
+    if (opts->benchmarks_length == 0) return 1;
+    for (int i = 0; i < opts->benchmarks_length; ++i)
+        if (strcmp(opts->benchmarks[i], name) == 0) return 1;
+    return 0;
+}
+
+/**
+ * \brief   Main.
+ */
+int main(int argc, char* const argv[])
+{
+    int first = 1;
+
+    // Parse command line.
+    parse_command_line(&program_opts, argc, argv);
+    for (int i = 0; i < program_opts.benchmarks_length; ++i)
+    {
+        size_t b;
+        for (b = 0; b < BENCHMARKS_LENGTH; ++b)
+            if (strcmp(program_opts.benchmarks[i], benchmarks[b].name) == 0)
+                break;
+        if (b == BENCHMARKS_LENGTH)
+        {
+            fprintf(stderr, "Unknown benchmark: %s\n", program_opts.benchmarks[i]);
+            return 1;
+        }
+    }
+
+    print_header(program_opts.format);
+    for (size_t b = 0; b < BENCHMARKS_LENGTH; ++b)
+    {
+        if (!selected(&program_opts, benchmarks[b].name)) continue;
+        for (size_t t = 0; t < program_opts.threads_length; ++t)
+        {
+            bench_result result = { 0, 0, NULL };
+            latency_summary summary;
+            size_t threads = program_opts.threads[t];
+
+            if (benchmarks[b].run(&result, threads, program_opts.iterations) < 0)
+                DIE("Benchmark %s failed at %zu threads", benchmarks[b].name,
+                    threads);
+            latency_summarise(&summary, result.samples, result.ops);
+            print_result(program_opts.format, first, benchmarks[b].name,
+                         threads, &result, &summary);
+            first = 0;
+            free(result.samples);
+        }
+    }
+    print_footer(program_opts.format, first);
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * \file   capture.c
+ * \author Jonathan Simmonds
+ * \brief  Request capture log API.
+ */
+#include <assert.h>     // assert
+#include <fcntl.h>      // open, O_APPEND, O_CREAT, O_RDWR
+#include <string.h>     // memcmp
+#include <sys/stat.h>   // fstat
+#include <sys/uio.h>    // writev
+#include <unistd.h>     // close, pread, write
+
+#include "capture.h"
+
+
+#define CAPTURE_MODE    (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+
+static void encode_u64(unsigned char* buf, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) buf[i] = value >> (8 * i);
+}
+
+static void encode_u32(unsigned char* buf, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) buf[i] = value >> (8 * i);
+}
+
+static uint64_t decode_u64(const unsigned char* buf)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) value = (value << 8) | buf[i];
+    return value;
+}
+
+static uint32_t decode_u32(const unsigned char* buf)
+{
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) value = (value << 8) | buf[i];
+    return value;
+}
+
+
+int capture_open(capture_log* log, const char* path)
+{
+    struct stat statbuf;
+    char magic[CAPTURE_MAGICLEN];
+    assert(log);
+    assert(path);
+
+    log->fd = open(path, O_CREAT | O_RDWR | O_APPEND, CAPTURE_MODE);
+    if (log->fd < 0) return -1;
+    if (fstat(log->fd, &statbuf) < 0) goto error;
+
+    // A new log starts with the magic, an existing one is appended to as long
+    // as it is a capture log.
+    if (statbuf.st_size == 0)
+    {
+        if (write(log->fd, CAPTURE_MAGIC, CAPTURE_MAGICLEN) != CAPTURE_MAGICLEN)
+            goto error;
+    }
+    else if (pread(log->fd, magic, CAPTURE_MAGICLEN, 0) != CAPTURE_MAGICLEN ||
+             memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGICLEN) != 0)
+    {
+        goto error;
+    }
+    return 0;
+
+error:
+    close(log->fd);
+    log->fd = -1;
+    return -1;
+}
+
+void capture_close(capture_log* log)
+{
+    assert(log);
+    if (log->fd >= 0) close(log->fd);
+    log->fd = -1;
+}
+
+int capture_append(capture_log* log, const capture_record* record,
+                   const char* data)
+{
+    unsigned char header[CAPTURE_HEADERLEN];
+    struct iovec iov[2];
+    ssize_t len = CAPTURE_HEADERLEN + record->length;
+    assert(log);
+    assert(record);
+
+    encode_u64(header, record->timestamp);
+    encode_u64(header + 8, record->latency);
+    encode_u32(header + 16, record->length);
+    iov[0].iov_base = header;
+    iov[0].iov_len = CAPTURE_HEADERLEN;
+    iov[1].iov_base = (void*) data;
+    iov[1].iov_len = record->length;
+
+    // O_APPEND makes the single write atomic with respect to other appenders.
+    return writev(log->fd, iov, 2) == len ? 0 : -1;
+}
+
+int capture_read_magic(FILE* fp)
+{
+    char magic[CAPTURE_MAGICLEN];
+    assert(fp);
+
+    if (fread(magic, 1, CAPTURE_MAGICLEN, fp) != CAPTURE_MAGICLEN) return -1;
+    return memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGICLEN) == 0 ? 0 : -1;
+}
+
+int capture_read(FILE* fp, capture_record* record, char* data, size_t datalen)
+{
+    unsigned char header[CAPTURE_HEADERLEN];
+    size_t len;
+    assert(fp);
+    assert(record);
+    assert(data);
+
+    len = fread(header, 1, CAPTURE_HEADERLEN, fp);
+    if (len == 0 && feof(fp)) return 0;
+    if (len != CAPTURE_HEADERLEN) return -1;
+    record->timestamp = decode_u64(header);
+    record->latency = decode_u64(header + 8);
+    record->length = decode_u32(header + 16);
+    if (record->length > datalen) return -1;
+    if (fread(data, 1, record->length, fp) != record->length) return -1;
+    return 1;
+}
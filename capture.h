@@ -0,0 +1,95 @@
+/**
+ * \file   capture.h
+ * \author Jonathan Simmonds
+ * \brief  Request capture log API.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t, uint32_t
+#include <stdio.h>      // FILE
+
+/** Magic the capture log starts with, identifying the format and version. */
+#define CAPTURE_MAGIC       "ACQCAP1\n"
+#define CAPTURE_MAGICLEN    8
+/** Length of an encoded record header. */
+#define CAPTURE_HEADERLEN   20
+
+/**
+ * \brief   Header of a single captured request. Each record is encoded as
+ *      timestamp (8 bytes), latency (8 bytes) and length (4 bytes), all little
+ *      endian, followed by the request's length bytes exactly as read.
+ */
+typedef struct capture_record_t
+{
+    /** Monotonic time the request's connection was accepted, in
+     *  nanoseconds. */
+    uint64_t timestamp;
+    /** Time from the request's connection being accepted to its reply being
+     *  sent, in nanoseconds. */
+    uint64_t latency;
+    /** Length of the request in bytes. */
+    uint32_t length;
+} capture_record;
+
+/**
+ * \brief   Structure representing a capture log open for appending.
+ */
+typedef struct capture_log_t
+{
+    /** File descriptor of the log, < 0 if capturing is disabled. */
+    int fd;
+} capture_log;
+
+/**
+ * \brief   Opens a capture log for appending, creating it if necessary.
+ *
+ * \param log   Pointer to the capture_log struct to initialise. Not NULL.
+ * \param path  Path to the log file. Not NULL.
+ * \return  0 on success, < 0 on error (including if the file exists and is
+ *      not a capture log).
+ */
+int capture_open(capture_log* log, const char* path);
+
+/**
+ * \brief   Closes a capture log.
+ *
+ * \param log   Pointer to the capture_log struct to close. Not NULL.
+ */
+void capture_close(capture_log* log);
+
+/**
+ * \brief   Appends a request to the capture log. Threadsafe: each record is
+ *      appended with a single write so records from concurrent callers are
+ *      never interleaved.
+ *
+ * \param log       The open capture log. Not NULL.
+ * \param record    The record header. Not NULL.
+ * \param data      The request, record->length bytes long.
+ * \return  0 on success, < 0 on error.
+ */
+int capture_append(capture_log* log, const capture_record* record,
+                   const char* data);
+
+/**
+ * \brief   Reads and checks the magic at the start of a capture log.
+ *
+ * \param fp    The capture log, positioned at its start. Not NULL.
+ * \return  0 on success, < 0 if the file is not a capture log.
+ */
+int capture_read_magic(FILE* fp);
+
+/**
+ * \brief   Reads the next record from a capture log.
+ *
+ * \param fp        The capture log. Not NULL.
+ * \param record    Pointer to populate with the record header. Not NULL.
+ * \param data      Buffer to read the request into. Not NULL.
+ * \param datalen   Length of the data buffer. Longer requests are an error.
+ * \return  1 if a record was read, 0 at the end of the log, < 0 on error
+ *      (including a truncated record).
+ */
+int capture_read(FILE* fp, capture_record* record, char* data, size_t datalen);
+
+#endif // CAPTURE_H
@@ -6,12 +6,14 @@
  */
 #include <netinet/in.h> // sockaddr_in
 #include <stdio.h>      // popen, pclose, fgets, sscanf
+#include <string.h>     // strlen
 #include <sys/socket.h> // socket, connect
 #include <unistd.h>     // read, write, close
 
 #include "log.h" // DIE
 
-#define RD_BUFLEN 256
+#define RD_BUFLEN 65536
+#define DEFAULT_COMMAND "print"
 
 static unsigned int daemon_port = 0;
 
@@ -40,8 +42,10 @@ unsigned int get_daemon_port(void)
  * \brief   Invokes the acquisition daemon to retrieve the connection
  *      information, connects and uses the simple command interface to issue a
  *      query and print the result.
+ *
+ * \param command   The command to issue. Not NULL.
  */
-void invoke_acquired(void)
+void invoke_acquired(const char* command)
 {
     int socket_fd;
     struct sockaddr_in socket_addr;
@@ -64,11 +68,19 @@ void invoke_acquired(void)
         DIE("Failed to connect to daemon at localhost:%u", daemon_port);
 
     // Send the command.
-    if (write(socket_fd, "print", 6) <= 0) DIE("Failed to write to daemon");
+    if (write(socket_fd, command, strlen(command) + 1) <= 0)
+        DIE("Failed to write to daemon");
 
-    // Read the response.
-    read_len = read(socket_fd, buf, RD_BUFLEN);
-    if (read_len <= 0) DIE("Failed to read from daemon");
+    // Read the response, which ends when the daemon closes the connection.
+    read_len = 0;
+    while (read_len < RD_BUFLEN - 1)
+    {
+        ssize_t ret = read(socket_fd, buf + read_len, RD_BUFLEN - 1 - read_len);
+        if (ret < 0) DIE("Failed to read from daemon");
+        if (ret == 0) break;
+        read_len += ret;
+    }
+    if (read_len == 0) DIE("Failed to read from daemon");
     buf[read_len] = '\0';
     printf("Successfully read from daemon: %s\n", buf);
 
@@ -76,11 +88,12 @@ void invoke_acquired(void)
 }
 
 /**
- * \brief   Main.
+ * \brief   Main. The optional first argument is the command to issue, e.g.
+ *      "get RESOURCE" or "set RESOURCE VALUE".
  */
 int main(int argc, char* const argv[])
 {
-    invoke_acquired();
+    invoke_acquired(argc > 1 ? argv[1] : DEFAULT_COMMAND);
 
     return 0;
 }
\ No newline at end of file
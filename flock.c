@@ -4,20 +4,32 @@
  * \brief  File locking API.
  */
 #include <assert.h>     // assert
+#include <errno.h>      // errno, ESRCH
 #include <fcntl.h>      // O_CREAT, O_RDWR, O_TRUNC, F_LOCK, F_ULOCK
-#include <stdio.h>      // fopen, fclose, fprintf, vfprintf, fileno, fflush,
-                        // fread
-#include <stdlib.h>     // exit
-#include <sys/stat.h>   // stat
+#include <sched.h>      // sched_yield
+#include <signal.h>     // kill
+#include <stdio.h>      // fopen, fclose, fprintf, fread, snprintf, dprintf,
+                        // sscanf, remove
+#include <stdlib.h>     // exit, strtoull
+#include <string.h>     // strcmp, strrchr, strchr, strlen
+#include <sys/stat.h>   // stat, fstat
 #include <sys/types.h>  // getopt, stat
+#include <time.h>       // clock_gettime
 #include <unistd.h>     // getopt, lockf, gethostname, getpid, stat, access,
-                        // link, lseek
+                        // link, lseek, pread, pwrite, rename
 
 #include "flock.h"
 
 
 #define LOCK_MODE   (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 #define MAXHOSTNAME 1024
+#define MAXRECORD   (MAXHOSTNAME + 64)
+// A lock file is always linked with its owner record already written, so one
+// without a record for this long was left by something else, e.g. an older
+// version, and is stale.
+#define RECORD_GRACE_MS 1000
+// Fixed width so the record can be rewritten in place by transfer_flock.
+#define OWNER_FMT   "owner %s %10d %20llu\n"
 #define DIE(...) \
 { \
     fprintf(stderr, ##__VA_ARGS__); \
@@ -26,16 +38,221 @@
     exit(1); \
 }
 
+/**
+ * \brief   Owner record stored at the start of a lock file.
+ */
+typedef struct flock_owner_t
+{
+    char host[MAXHOSTNAME];
+    int pid;
+    unsigned long long token;
+} flock_owner;
+
+
+/**
+ * \brief   Reads a process's state and liveness token from /proc/PID/stat.
+ *      The token is the process's start time, in clock ticks since boot, so a
+ *      pid which has been recycled will have a different token.
+ *
+ * \param pid   The process to query.
+ * \param state Pointer to populate with the process state, e.g. 'Z' for a
+ *      zombie. May be NULL.
+ * \return  The token, or 0 if it could not be determined.
+ */
+static unsigned long long process_token(pid_t pid, char* state)
+{
+    char path[64];
+    char buf[1024];
+    char* field;
+    size_t len;
+    FILE* f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    f = fopen(path, "r");
+    if (f == NULL) return 0;
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    // The command name (field 2) may contain spaces, so count fields from the
+    // closing parenthesis. The state is field 3, the start time field 22.
+    field = strrchr(buf, ')');
+    if (field == NULL || field[1] == '\0') return 0;
+    if (state) *state = field[2];
+    for (int i = 2; field && i < 22; ++i)
+        field = strchr(field + 1, ' ');
+    return field ? strtoull(field + 1, NULL, 10) : 0;
+}
+
+/**
+ * \brief   Parses the owner record at the start of a lock file's contents.
+ *
+ * \return  The length of the record, or -1 if there isn't a complete one.
+ */
+static int parse_owner(const char* buf, flock_owner* owner)
+{
+    int len = -1;
+    if (sscanf(buf, "owner %1023s %d %llu%n", owner->host, &owner->pid,
+               &owner->token, &len) != 3 || len < 0 || buf[len] != '\n')
+        return -1;
+    return len + 1;
+}
+
+/**
+ * \brief   Determines whether a lock's owner has died. Owners on other hosts
+ *      can't be checked and are assumed to be alive.
+ */
+static int owner_dead(const flock_owner* owner)
+{
+    char hostname[MAXHOSTNAME];
+    unsigned long long token;
+    char state = '\0';
+
+    gethostname(hostname, MAXHOSTNAME);
+    if (strcmp(owner->host, hostname) != 0) return 0;
+    if (kill(owner->pid, 0) < 0 && errno == ESRCH) return 1;
+
+    // The pid exists, but may be a zombie or have been recycled.
+    token = process_token(owner->pid, &state);
+    if (token == 0) return 0;
+    return state == 'Z' || state == 'X' ||
+        (owner->token && token != owner->token);
+}
+
+/**
+ * \brief   Reads the owner record of the lock file.
+ *
+ * \return  0 on success, -1 if the lock file doesn't exist or has no owner
+ *      record.
+ */
+static int read_owner(const char* glob_fp, flock_owner* owner)
+{
+    char buf[MAXRECORD];
+    ssize_t len;
+    int fd = open(glob_fp, O_RDONLY);
+    if (fd < 0) return -1;
+    len = pread(fd, buf, MAXRECORD - 1, 0);
+    close(fd);
+    buf[len > 0 ? len : 0] = '\0';
+    return parse_owner(buf, owner) < 0 ? -1 : 0;
+}
+
+/**
+ * \brief   Determines whether a lock file which has no owner record has been
+ *      without one for longer than RECORD_GRACE_MS.
+ *
+ * \param statbuf   The lock file's status. Not NULL.
+ */
+static int record_overdue(const struct stat* statbuf)
+{
+    struct timespec now;
+    long long age_ms;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    age_ms = (now.tv_sec - statbuf->st_mtim.tv_sec) * 1000LL +
+        (now.tv_nsec - statbuf->st_mtim.tv_nsec) / 1000000;
+    return age_ms > RECORD_GRACE_MS;
+}
+
+/**
+ * \brief   Determines whether a lock file is stale: either its owner has died
+ *      or it has had no owner record for too long.
+ *
+ * \param glob_fp   Path to the lock file. Not NULL.
+ * \param owner     Pointer to populate with the owner record. The pid is set
+ *      to 0 if there is no owner record.
+ * \return  1 if the lock is stale, 0 if it is held, -1 if the lock file
+ *      doesn't exist.
+ */
+static int lock_stale(const char* glob_fp, flock_owner* owner)
+{
+    struct stat statbuf;
+
+    if (read_owner(glob_fp, owner) == 0)
+        return owner_dead(owner);
+    owner->pid = 0;
+    if (stat(glob_fp, &statbuf) < 0) return -1;
+    return record_overdue(&statbuf);
+}
+
+/**
+ * \brief   Forms the path of a process's unique lock file.
+ *
+ * \return  0 on success, -1 if the path doesn't fit in pathlen bytes.
+ */
+static int uniq_path(char* path, size_t pathlen, const char* glob_fp,
+                     const char* host, int pid)
+{
+    int len = snprintf(path, pathlen, "%s.%s.%d", glob_fp, host, pid);
+    return len < 0 || (size_t) len >= pathlen ? -1 : 0;
+}
+
+/**
+ * \brief   Breaks the lock file if it is stale (see lock_stale). Breaking is
+ *      serialised by a unix file lock on a separate, persistent, break file
+ *      (which the kernel releases if the breaker itself dies) and the lock is
+ *      checked again once it is held. As only breakers remove a stale lock
+ *      file, the lock file cannot change between that check and its removal.
+ *
+ * \return  0 if the lock file no longer exists, -1 if it is still held.
+ */
+static int break_stale_flock(flock* lock)
+{
+    char path[MAXPATH + 8];
+    flock_owner owner;
+    int break_fd;
+    int len;
+    int ret;
+
+    // Cheap check first, so contending for a live lock stays cheap.
+    ret = lock_stale(lock->glob_fp, &owner);
+    if (ret <= 0) return ret < 0 ? 0 : -1;
+
+    len = snprintf(path, sizeof(path), "%s.break", lock->glob_fp);
+    if (len < 0 || (size_t) len >= sizeof(path)) DIE("Lock file path too long");
+    break_fd = open(path, O_CREAT | O_RDWR, LOCK_MODE);
+    if (break_fd < 0) DIE("Failed to open break lock file");
+    if (lockf(break_fd, F_LOCK, 0) < 0)
+        perror("Failed to acquire r/w lock on break lock file");
+
+    ret = lock_stale(lock->glob_fp, &owner);
+    if (ret < 0)
+    {
+        // Already broken by someone else.
+        ret = 0;
+    }
+    else if (ret == 0)
+    {
+        ret = -1;
+    }
+    else
+    {
+        if (remove(lock->glob_fp) < 0) perror("Failed to remove stale lock file");
+        // A unique lock path which doesn't fit can never have been created.
+        if (owner.pid &&
+            uniq_path(path, MAXPATH, lock->glob_fp, owner.host, owner.pid) == 0)
+            remove(path);
+        ret = 0;
+    }
+
+    if (lockf(break_fd, F_ULOCK, 0) < 0)
+        perror("Failed to release r/w lock on break lock file");
+    close(break_fd);
+    return ret;
+}
+
 int acquire_flock(flock* lock)
 {
     char hostname[MAXHOSTNAME];
     pid_t pid;
     struct stat statbuf;
+    int len;
     assert(lock);
     assert(lock->glob_fp);
 
-    // Does the global lock file already exist? If so we can never acquire it.
-    if (access(lock->glob_fp, F_OK) == 0)
+    // Does the global lock file already exist? If so we can only acquire it
+    // if its owner has died.
+    if (access(lock->glob_fp, F_OK) == 0 && break_stale_flock(lock) < 0)
         return -1;
 
     // Lock implemented as per description on the open() man2 page; avoiding
@@ -44,11 +261,17 @@ int acquire_flock(flock* lock)
     // Form the unique lock name.
     gethostname(hostname, MAXHOSTNAME);
     pid = getpid();
-    snprintf(lock->uniq_fp, MAXPATH, "%s.%s.%d", lock->glob_fp, hostname, pid);
+    if (uniq_path(lock->uniq_fp, MAXPATH, lock->glob_fp, hostname, pid) < 0)
+        DIE("Lock file path too long");
 
-    // Open the unique lock.
+    // Open the unique lock and write the owner record before linking, so the
+    // global lock is never seen without one.
     lock->uniq_fd = open(lock->uniq_fp, O_CREAT | O_TRUNC | O_RDWR, LOCK_MODE);
     if (lock->uniq_fd < 0) DIE("Failed to open unique lock file");
+    len = dprintf(lock->uniq_fd, OWNER_FMT, hostname, (int) pid,
+                  process_token(pid, NULL));
+    if (len < 0) DIE("Failed to write unique lock file");
+    lock->post_offset = len;
 
     // Try to link the (global) lock file to our unique lock file.
     if (link(lock->uniq_fp, lock->glob_fp) != 0)
@@ -95,49 +318,106 @@ void release_flock(flock* lock)
     if (remove(lock->uniq_fp) < 0) perror("Failed to remove unique lock file");
 }
 
+void transfer_flock(flock* lock)
+{
+    char hostname[MAXHOSTNAME];
+    char uniq_fp[MAXPATH];
+    char record[MAXRECORD];
+    pid_t pid;
+    int len;
+    assert(lock);
+    assert(lock->uniq_fd);
+
+    // Rename the unique lock to match the new owner so a breaker can find it.
+    gethostname(hostname, MAXHOSTNAME);
+    pid = getpid();
+    if (uniq_path(uniq_fp, MAXPATH, lock->glob_fp, hostname, pid) < 0)
+        DIE("Lock file path too long");
+    if (rename(lock->uniq_fp, uniq_fp) < 0) DIE("Failed to rename unique lock file");
+    strcpy(lock->uniq_fp, uniq_fp);
+
+    // Rewrite the owner record in place, leaving any posted message intact.
+    len = snprintf(record, MAXRECORD, OWNER_FMT, hostname, (int) pid,
+                   process_token(pid, NULL));
+    assert(len == (int) lock->post_offset);
+    if (pwrite(lock->uniq_fd, record, len, 0) != len)
+        DIE("Failed to write unique lock file");
+}
+
 void post_to_flock(flock* lock, const char* msg)
 {
     assert(lock);
     assert(lock->glob_fd);
     assert(msg);
-    FILE* glob_fs = fdopen(lock->glob_fd, "w");
-    fprintf(glob_fs, "%s", msg);
-    fflush(glob_fs);
+    // Write after the owner record. The file offset must be left at 0 so the
+    // unlock covers the whole file.
+    if (pwrite(lock->glob_fd, msg, strlen(msg), lock->post_offset) < 0)
+        perror("Failed to post to global lock file");
     lseek(lock->glob_fd, 0, SEEK_SET);
     if (lockf(lock->glob_fd, F_ULOCK, 0) < 0)
         perror("Failed to release r/w lock on global lock file");
 }
 
-void await_flock_post(char* msg, size_t msglen, flock* lock)
+int await_flock_post(char* msg, size_t msglen, flock* lock)
 {
+    char buf[MAXRECORD + msglen];
+    ssize_t read_size;
+    int record_len;
+    int ret = -1;
+    flock_owner owner;
+    struct stat statbuf;
+    int glob_fd;
     assert(lock);
     assert(lock->glob_fp);
     assert(msg);
     assert(msglen);
-    size_t read_size = 0;
-    int glob_fd = open(lock->glob_fp, O_RDWR);
+
+    // If the lock file has already gone its owner has exited.
+    glob_fd = open(lock->glob_fp, O_RDWR);
     if (glob_fd < 0)
-        perror("Failed to open global lock file");
+        return -1;
 
     // Spin waiting for the file lock to be posted to. This uses unix file locks
     // to save spin-lock cycles, but this is purely an optimisation. As noted
     // above, it is possible for a child process to await a flock before the
     // flock initialisation has acquired the unix file lock. For that reason
-    // the call is still wrapped as a spin lock.
-    while (read_size == 0)
+    // the call is still wrapped as a spin lock. If the owner dies the unix
+    // file lock is released, so the spin also checks the owner is alive.
+    for (;;)
     {
         // Wait until unix file lock is released.
         if (lockf(glob_fd, F_LOCK, 0) < 0)
             perror("Failed to wait for r/w lock on global lock file");
 
         // Read the contents.
-        read_size = read(glob_fd, msg, msglen);
-        msg[msglen-1] = '\0';
+        read_size = pread(glob_fd, buf, sizeof(buf) - 1, 0);
+        buf[read_size > 0 ? read_size : 0] = '\0';
 
         // Release the unix file lock.
         if (lockf(glob_fd, F_ULOCK, 0) < 0)
             perror("Failed to release tested r/w lock on global lock file");
+
+        // Stop waiting if the lock has been released (or broken).
+        if (fstat(glob_fd, &statbuf) < 0 || statbuf.st_nlink == 0)
+            break;
+
+        // The owner record is written before the lock file is linked, so a
+        // lock which has been without one for too long is stale, just like
+        // one whose owner has died, and must be broken by the caller.
+        record_len = parse_owner(buf, &owner);
+        if (record_len < 0 ? record_overdue(&statbuf) : owner_dead(&owner))
+        {
+            break;
+        }
+        else if (record_len >= 0 && read_size > record_len)
+        {
+            snprintf(msg, msglen, "%s", buf + record_len);
+            ret = 0;
+            break;
+        }
+        sched_yield();
     }
 
     close(glob_fd);
-}
\ No newline at end of file
+    return ret;
+}
@@ -6,11 +6,22 @@
 #ifndef FLOCK_H
 #define FLOCK_H
 
+#include <stddef.h>     // size_t
+
 #define MAXPATH     1024
 
 /**
  * \brief   Structure representing a file lock. Only glob_fp is intended to be
  *      interactive with by clients.
+ *
+ *      The lock file starts with an owner record, "owner HOST PID TOKEN\n",
+ *      identifying the process holding it. TOKEN is the owning process's start
+ *      time, so a recycled pid is not mistaken for the owner. Any message
+ *      posted to the lock follows the owner record. A lock whose owner is
+ *      known to have died (only determinable on the same host), or which has
+ *      had no owner record for over a second (e.g. one left by an older
+ *      version), is stale and is broken by the next process to try to acquire
+ *      it.
  */
 typedef struct flock_t
 {
@@ -23,6 +34,9 @@ typedef struct flock_t
     int glob_fd;
     /** File descriptor of this process's unique file lock. */
     int uniq_fd;
+    /** Offset of the posted message in the lock file, i.e. the length of the
+     *  owner record. */
+    size_t post_offset;
 } flock;
 
 /**
@@ -32,6 +46,9 @@ typedef struct flock_t
  *      initialised to the file path of the file lock to acquire. All other
  *      fields should be left uninitialised.
  *
+ *      If the file lock is held by a process which has died it is broken
+ *      and acquired.
+ *
  * \return  0 on success, in which case the file lock has been acquired and the
  *      passed lock object has been populated. -1 on error, in which case the
  *      file lock could not be acquired and is already owned by another process.
@@ -46,6 +63,17 @@ int acquire_flock(flock* lock);
  */
 void release_flock(flock* lock);
 
+/**
+ * \brief   Transfers an acquired file lock to the calling process, which must
+ *      be a child of the process which acquired it (e.g. after forking to run
+ *      in the background). Must be called before the acquiring process exits
+ *      or the lock will be seen as stale.
+ *
+ * \param lock  Pointer to flock struct which has previously been acquired by
+ *      the parent process. Not NULL.
+ */
+void transfer_flock(flock* lock);
+
 /**
  * \brief   Posts a message into the file lock. This can be used to pass
  *      messages to other processes which are waiting on the file lock. This
@@ -58,7 +86,8 @@ void release_flock(flock* lock);
 void post_to_flock(flock* lock, const char* msg);
 
 /**
- * \brief   Blocks until a message is posted to a file lock.
+ * \brief   Blocks until a message is posted to a file lock, or until the
+ *      process owning the file lock is found to have died.
  *
  * \param msg       Pointer to the buffer to read the file lock's posted message
  *      into. Not NULL.
@@ -67,7 +96,11 @@ void post_to_flock(flock* lock, const char* msg);
  *      acquired (it makes no sense to call this function if this process owns
  *      the lock) the glob_fp field must be initialised to the file path of the
  *      file lock to wait on. All other fields should be left uninitialised.
+ * \return  0 on success, in which case msg holds the posted message. -1 if the
+ *      file lock's owner died (with or without posting), the file lock is
+ *      otherwise stale or the file lock was released, in which case the caller
+ *      should try to acquire it again.
  */
-void await_flock_post(char* msg, size_t msglen, flock* lock);
+int await_flock_post(char* msg, size_t msglen, flock* lock);
 
 #endif // FLOCK_H
\ No newline at end of file
@@ -0,0 +1,61 @@
+/**
+ * \file   latency.c
+ * \author Jonathan Simmonds
+ * \brief  Latency sampling and summary API.
+ */
+#include <assert.h>     // assert
+#include <stdlib.h>     // qsort
+#include <string.h>     // memset
+#include <time.h>       // clock_gettime
+
+#include "latency.h"
+
+
+static int compare_samples(const void* a_raw, const void* b_raw)
+{
+    uint64_t a = *(const uint64_t*) a_raw;
+    uint64_t b = *(const uint64_t*) b_raw;
+    return (a > b) - (a < b);
+}
+
+/**
+ * \brief   Nearest-rank percentile of a sorted sample array.
+ */
+static uint64_t percentile(const uint64_t* sorted, size_t length,
+                           unsigned int per_mille)
+{
+    size_t rank = (length * per_mille + 999) / 1000;
+    if (rank == 0) rank = 1;
+    return sorted[rank - 1];
+}
+
+uint64_t latency_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void latency_summarise(latency_summary* summary, uint64_t* samples,
+                       size_t length)
+{
+    uint64_t total = 0;
+    assert(summary);
+
+    memset(summary, 0, sizeof(*summary));
+    if (length == 0) return;
+    assert(samples);
+
+    qsort(samples, length, sizeof(*samples), compare_samples);
+    for (size_t i = 0; i < length; ++i)
+        total += samples[i];
+
+    summary->count = length;
+    summary->mean  = total / length;
+    summary->min   = samples[0];
+    summary->p50   = percentile(samples, length, 500);
+    summary->p90   = percentile(samples, length, 900);
+    summary->p99   = percentile(samples, length, 990);
+    summary->p999  = percentile(samples, length, 999);
+    summary->max   = samples[length - 1];
+}
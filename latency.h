@@ -0,0 +1,56 @@
+/**
+ * \file   latency.h
+ * \author Jonathan Simmonds
+ * \brief  Latency sampling and summary API.
+ */
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+
+/**
+ * \brief   Structure summarising a set of latency samples. All times are in
+ *      nanoseconds.
+ */
+typedef struct latency_summary_t
+{
+    /** Number of samples summarised. */
+    size_t   count;
+    /** Arithmetic mean of the samples. */
+    uint64_t mean;
+    /** Smallest sample. */
+    uint64_t min;
+    /** 50th percentile (median) sample. */
+    uint64_t p50;
+    /** 90th percentile sample. */
+    uint64_t p90;
+    /** 99th percentile sample. */
+    uint64_t p99;
+    /** 99.9th percentile sample. */
+    uint64_t p999;
+    /** Largest sample. */
+    uint64_t max;
+} latency_summary;
+
+/**
+ * \brief   Reads the monotonic clock. Values are comparable between processes
+ *      on the same host.
+ *
+ * \return  The current monotonic time in nanoseconds.
+ */
+uint64_t latency_now(void);
+
+/**
+ * \brief   Summarises a set of latency samples. The samples are sorted in
+ *      place.
+ *
+ * \param summary   Pointer to the summary to populate. Not NULL.
+ * \param samples   Array of samples, in nanoseconds. May be NULL if length is
+ *      0, in which case the summary is zeroed.
+ * \param length    Number of samples in the array.
+ */
+void latency_summarise(latency_summary* summary, uint64_t* samples,
+                       size_t length);
+
+#endif // LATENCY_H
@@ -0,0 +1,163 @@
+/**
+ * \file   notify.c
+ * \author Jonathan Simmonds
+ * \brief  Publish/subscribe API for fanning change events out to subscribers.
+ */
+#include <assert.h>     // assert
+#include <pthread.h>    // pthread_mutex_*
+#include <stdlib.h>     // malloc, free
+#include <string.h>     // memcpy
+
+#include "notify.h"
+
+
+/**
+ * \brief   Queue index of the i'th oldest event. Must hold the subscriber lock.
+ */
+static size_t queue_index(const notify_subscriber* sub, size_t i)
+{
+    return (sub->head + i) % NOTIFY_QUEUE_LENGTH;
+}
+
+notify_event* notify_event_create(const void* key, const char* data,
+                                  size_t length)
+{
+    notify_event* event;
+    assert(data);
+
+    event = malloc(sizeof(notify_event) + length);
+    if (event == NULL) return NULL;
+    event->refs = 1;
+    event->key = key;
+    event->length = length;
+    memcpy(event->data, data, length);
+    return event;
+}
+
+static void notify_event_retain(notify_event* event)
+{
+    __atomic_add_fetch(&event->refs, 1, __ATOMIC_RELAXED);
+}
+
+void notify_event_release(notify_event* event)
+{
+    assert(event);
+    if (__atomic_sub_fetch(&event->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(event);
+}
+
+int notify_subscriber_create(notify_subscriber* sub)
+{
+    assert(sub);
+
+    sub->wake = NULL;
+    sub->wake_arg = NULL;
+    sub->head = 0;
+    sub->length = 0;
+    sub->coalesced = 0;
+    sub->dropped = 0;
+    return pthread_mutex_init(&sub->lock, NULL) == 0 ? 0 : -1;
+}
+
+void notify_subscriber_destroy(notify_subscriber* sub)
+{
+    assert(sub);
+
+    for (size_t i = 0; i < sub->length; ++i)
+        notify_event_release(sub->queue[queue_index(sub, i)]);
+    sub->length = 0;
+    pthread_mutex_destroy(&sub->lock);
+}
+
+int notify_subscribe(notify_link** topic, notify_subscriber* sub)
+{
+    notify_link* link;
+    assert(topic);
+    assert(sub);
+
+    link = malloc(sizeof(notify_link));
+    if (link == NULL) return -1;
+    link->subscriber = sub;
+    link->next = *topic;
+    *topic = link;
+    return 0;
+}
+
+void notify_unsubscribe(notify_link** topic, notify_subscriber* sub)
+{
+    assert(topic);
+    assert(sub);
+
+    for (; *topic; topic = &(*topic)->next)
+    {
+        if ((*topic)->subscriber == sub)
+        {
+            notify_link* link = *topic;
+            *topic = link->next;
+            free(link);
+            return;
+        }
+    }
+}
+
+/**
+ * \brief   Queues an event for a single subscriber, replacing any queued event
+ *      with the same key or, failing that, dropping the oldest event if the
+ *      queue is full.
+ */
+static void queue_event(notify_subscriber* sub, notify_event* event)
+{
+    pthread_mutex_lock(&sub->lock);
+    notify_event_retain(event);
+
+    // Replace the queued event about the same thing, if any, so the
+    // subscriber only sees the latest state.
+    for (size_t i = 0; i < sub->length; ++i)
+    {
+        size_t index = queue_index(sub, i);
+        if (sub->queue[index]->key == event->key)
+        {
+            notify_event_release(sub->queue[index]);
+            sub->queue[index] = event;
+            sub->coalesced++;
+            pthread_mutex_unlock(&sub->lock);
+            return;
+        }
+    }
+
+    // Otherwise drop the oldest if there is no room.
+    if (sub->length == NOTIFY_QUEUE_LENGTH)
+    {
+        notify_event_release(sub->queue[sub->head]);
+        sub->head = queue_index(sub, 1);
+        sub->length--;
+        sub->dropped++;
+    }
+    sub->queue[queue_index(sub, sub->length++)] = event;
+    if (sub->wake) sub->wake(sub->wake_arg);
+    pthread_mutex_unlock(&sub->lock);
+}
+
+void notify_publish(notify_link* topic, notify_event* event)
+{
+    assert(event);
+
+    for (; topic; topic = topic->next)
+        queue_event(topic->subscriber, event);
+}
+
+notify_event* notify_pop(notify_subscriber* sub)
+{
+    notify_event* event = NULL;
+    assert(sub);
+
+    pthread_mutex_lock(&sub->lock);
+    if (sub->length > 0)
+    {
+        event = sub->queue[sub->head];
+        sub->head = queue_index(sub, 1);
+        sub->length--;
+    }
+    pthread_mutex_unlock(&sub->lock);
+    return event;
+}
@@ -0,0 +1,146 @@
+/**
+ * \file   notify.h
+ * \author Jonathan Simmonds
+ * \brief  Publish/subscribe API for fanning change events out to subscribers.
+ */
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <pthread.h>    // pthread_mutex_t
+#include <stddef.h>     // size_t
+
+/** Number of undelivered events each subscriber may have queued. */
+#define NOTIFY_QUEUE_LENGTH 16
+
+/**
+ * \brief   Reference counted, immutable event. Created once by the publisher
+ *      and shared by every subscriber it is delivered to.
+ */
+typedef struct notify_event_t
+{
+    /** Number of references. The event is freed when this reaches 0. */
+    int refs;
+    /** Identifies what the event is about. Events with equal keys may be
+     *  coalesced, keeping only the newest. */
+    const void* key;
+    /** Length of data. */
+    size_t length;
+    /** Serialised event. */
+    char data[];
+} notify_event;
+
+/**
+ * \brief   Structure representing a subscriber with a bounded queue of
+ *      undelivered events. At most one event per key is queued. Initialise
+ *      with notify_subscriber_create.
+ */
+typedef struct notify_subscriber_t
+{
+    /** Called whenever an event is queued, so it can be collected with
+     *  notify_pop. It is called with the topic's and the subscriber's locks
+     *  held so must not block. May be NULL. */
+    void (*wake)(void* arg);
+    /** Argument passed to wake. */
+    void* wake_arg;
+    /** Protects all fields below. */
+    pthread_mutex_t lock;
+    /** Ring buffer of queued events. */
+    notify_event* queue[NOTIFY_QUEUE_LENGTH];
+    /** Index of the oldest queued event. */
+    size_t head;
+    /** Number of queued events. */
+    size_t length;
+    /** Number of events replaced by a newer event with the same key. */
+    unsigned long coalesced;
+    /** Number of events dropped because the queue was full of events with
+     *  other keys. Never happens to a subscriber to at most
+     *  NOTIFY_QUEUE_LENGTH keys. */
+    unsigned long dropped;
+} notify_subscriber;
+
+/**
+ * \brief   Node in the list of subscribers to a topic. A topic is simply a
+ *      (notify_link*) list head protected by a lock of the caller's choosing.
+ */
+typedef struct notify_link_t
+{
+    notify_subscriber* subscriber;
+    struct notify_link_t* next;
+} notify_link;
+
+/**
+ * \brief   Creates an event with a single reference.
+ *
+ * \param key       Key identifying what the event is about. May be NULL.
+ * \param data      Serialised event to copy. Not NULL.
+ * \param length    Length of data.
+ * \return  The event, NULL on error.
+ */
+notify_event* notify_event_create(const void* key, const char* data,
+                                  size_t length);
+
+/**
+ * \brief   Releases a reference to an event, freeing it if this was the last.
+ *      This function is thread safe.
+ *
+ * \param event The event to release. Not NULL.
+ */
+void notify_event_release(notify_event* event);
+
+/**
+ * \brief   Creates a subscriber, initialising a notify_subscriber struct. The
+ *      wake callback is initialised to NULL.
+ *
+ * \param sub   The notify_subscriber struct to initialise.
+ * \return  0 on success, < 0 on error.
+ */
+int notify_subscriber_create(notify_subscriber* sub);
+
+/**
+ * \brief   Destroys a subscriber, releasing any undelivered events. The
+ *      subscriber must already have been unsubscribed from every topic.
+ *
+ * \param sub   The initialised subscriber to destroy.
+ */
+void notify_subscriber_destroy(notify_subscriber* sub);
+
+/**
+ * \brief   Subscribes to a topic. The topic's lock must be held.
+ *
+ * \param topic Pointer to the topic's list head. Not NULL.
+ * \param sub   The subscriber. Not NULL.
+ * \return  0 on success, < 0 on error.
+ */
+int notify_subscribe(notify_link** topic, notify_subscriber* sub);
+
+/**
+ * \brief   Unsubscribes from a topic. The topic's lock must be held.
+ *
+ * \param topic Pointer to the topic's list head. Not NULL.
+ * \param sub   The subscriber. Not NULL.
+ */
+void notify_unsubscribe(notify_link** topic, notify_subscriber* sub);
+
+/**
+ * \brief   Queues an event for every subscriber to a topic. This never blocks
+ *      on a subscriber: an event replaces (coalesces) any undelivered event
+ *      with the same key, so a subscriber always sees the latest state of
+ *      everything it subscribes to. Only if the queue is full of events with
+ *      other keys is the oldest dropped. The topic's lock must be held.
+ *
+ * \param topic The topic's list head. May be NULL (no subscribers).
+ * \param event The event to publish. Not NULL. The caller retains its own
+ *      reference.
+ */
+void notify_publish(notify_link* topic, notify_event* event);
+
+/**
+ * \brief   Removes the subscriber's oldest queued event. Never blocks.
+ *
+ * \param sub   The subscriber. Not NULL.
+ * \return  The event, which the caller must release, or NULL if none is
+ *      queued.
+ */
+notify_event* notify_pop(notify_subscriber* sub);
+
+#endif // NOTIFY_H
@@ -0,0 +1,590 @@
+/**
+ * \file   replay.c
+ * \author Jonathan Simmonds
+ * \brief  Replays requests captured by the acquisition daemon against a
+ *      daemon and reports the latencies alongside those captured.
+ */
+#include <assert.h>     // assert
+#include <errno.h>      // errno, EINTR
+#include <inttypes.h>   // PRIu64, PRId64
+#include <netinet/in.h> // sockaddr_in
+#include <pthread.h>    // pthread_create, pthread_join
+#include <stdint.h>     // uint64_t, int64_t
+#include <stdio.h>      // printf, fprintf, fopen, popen, pclose, fscanf,
+                        // fseek, ftell
+#include <stdlib.h>     // malloc, realloc, free, qsort, strtod, strtoul
+#include <string.h>     // strcmp, memcpy
+#include <sys/socket.h> // socket, connect, send, recv
+#include <time.h>       // clock_nanosleep
+#include <unistd.h>     // getopt, close
+
+#include "capture.h"
+#include "latency.h"
+#include "log.h" // DIE
+
+
+
+/*
+ * Defines
+ */
+
+#define DEFAULT_WORKERS     64
+#define REPLAY_BUFLEN       65536
+#define REPLAY_INITIAL      1024
+
+
+
+/*
+ * Structs
+ */
+
+typedef enum replay_format_t
+{
+    FORMAT_CSV,
+    FORMAT_JSON,
+} replay_format;
+
+typedef struct cl_opts_t
+{
+    replay_format format;
+    /** Port of the daemon to replay against, 0 to invoke ./acquired. */
+    unsigned int  port;
+    /** Replay speed as a multiple of the captured rate, 0 for as fast as
+     *  possible. */
+    double        speed;
+    size_t        workers;
+    /** Capture file written by the daemon being replayed against, NULL if
+     *  it isn't capturing. */
+    const char*   daemon_capture_file;
+    const char*   capture_file;
+} cl_opts;
+
+/**
+ * \brief   A captured request and the result of replaying it.
+ */
+typedef struct replay_request_t
+{
+    /** Time the request was captured, in nanoseconds. */
+    uint64_t timestamp;
+    /** Latency the request was captured with, in nanoseconds. */
+    uint64_t captured;
+    /** Latency the request was replayed with, in nanoseconds. */
+    uint64_t replayed;
+    /** How late the request was sent relative to its schedule, in
+     *  nanoseconds. */
+    uint64_t lag;
+    /** Non-zero if the request could not be replayed. */
+    int      failed;
+    uint32_t length;
+    char*    data;
+} replay_request;
+
+/**
+ * \brief   State shared between the replay worker threads.
+ */
+typedef struct replay_state_t
+{
+    replay_request* requests;
+    size_t          requests_length;
+    /** Index of the next request to send. */
+    size_t          next;
+    /** Monotonic time the replay started, in nanoseconds. */
+    uint64_t        start;
+    unsigned int    port;
+    double          speed;
+} replay_state;
+
+
+
+/*
+ * Globals
+ */
+
+extern char *optarg;    // getopt
+extern int optind;      // getopt
+cl_opts program_opts;
+
+
+
+/*
+ * Replay
+ */
+
+/**
+ * \brief   Invokes the acquisition daemon and retrieves the port for
+ *      communicating with it on. See client.c.
+ *
+ * \return Port number the daemon is using.
+ */
+static unsigned int get_daemon_port(void)
+{
+    unsigned int port;
+    FILE* proc_f = popen("./acquired", "r");
+    if (!proc_f) DIE("Failed to popen daemon");
+
+    if (fscanf(proc_f, "%u", &port) != 1) DIE("Failed to read from daemon");
+
+    pclose(proc_f);
+    return port;
+}
+
+static int compare_timestamps(const void* a_raw, const void* b_raw)
+{
+    const replay_request* a = a_raw;
+    const replay_request* b = b_raw;
+    return (a->timestamp > b->timestamp) - (a->timestamp < b->timestamp);
+}
+
+/**
+ * \brief   Loads every record from a capture log, sorted by capture time.
+ *
+ * \param path      Path to the capture log. Not NULL.
+ * \param length    Pointer to populate with the number of requests loaded.
+ * \return  The array of requests, to be freed with free_requests.
+ */
+static replay_request* load_requests(const char* path, size_t* length)
+{
+    FILE* fp;
+    replay_request* requests = NULL;
+    size_t capacity = 0;
+    capture_record record;
+    char data[REPLAY_BUFLEN];
+    int ret;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) DIE("Failed to open capture file %s", path);
+    if (capture_read_magic(fp) < 0) DIE("%s is not a capture file", path);
+
+    *length = 0;
+    while ((ret = capture_read(fp, &record, data, REPLAY_BUFLEN)) > 0)
+    {
+        replay_request* request;
+        if (*length == capacity)
+        {
+            capacity = capacity ? capacity * 2 : REPLAY_INITIAL;
+            requests = realloc(requests, sizeof(*requests) * capacity);
+            if (requests == NULL) DIE("Failed to allocate requests");
+        }
+        request = &requests[(*length)++];
+        request->timestamp = record.timestamp;
+        request->captured = record.latency;
+        request->replayed = 0;
+        request->lag = 0;
+        request->failed = 0;
+        request->length = record.length;
+        request->data = malloc(record.length);
+        if (request->data == NULL) DIE("Failed to allocate request");
+        memcpy(request->data, data, record.length);
+    }
+    if (ret < 0) DIE("Capture file %s is corrupt", path);
+    fclose(fp);
+
+    // Requests are captured as their replies are sent, so concurrent requests
+    // may be out of order.
+    qsort(requests, *length, sizeof(*requests), compare_timestamps);
+    return requests;
+}
+
+/**
+ * \brief   Finds the end of a capture log, so that the records appended to it
+ *      from then on can be loaded with load_latencies.
+ *
+ * \param path  Path to the capture log. Not NULL.
+ * \return  The offset of the end of the log.
+ */
+static long capture_end(const char* path)
+{
+    FILE* fp;
+    long end;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) DIE("Failed to open capture file %s", path);
+    if (capture_read_magic(fp) < 0) DIE("%s is not a capture file", path);
+    if (fseek(fp, 0, SEEK_END) < 0 || (end = ftell(fp)) < 0)
+        DIE("Failed to find the end of capture file %s", path);
+    fclose(fp);
+    return end;
+}
+
+/**
+ * \brief   Loads the latencies of the records in a capture log from the given
+ *      offset onwards.
+ *
+ * \param path      Path to the capture log. Not NULL.
+ * \param offset    Offset of the first record to load, from capture_end.
+ * \param length    Pointer to populate with the number of latencies loaded.
+ * \return  The array of latencies, to be freed.
+ */
+static uint64_t* load_latencies(const char* path, long offset, size_t* length)
+{
+    FILE* fp;
+    uint64_t* latencies = NULL;
+    size_t capacity = 0;
+    capture_record record;
+    char data[REPLAY_BUFLEN];
+    int ret;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) DIE("Failed to open capture file %s", path);
+    if (fseek(fp, offset, SEEK_SET) < 0) DIE("Failed to seek capture file %s", path);
+
+    *length = 0;
+    while ((ret = capture_read(fp, &record, data, REPLAY_BUFLEN)) > 0)
+    {
+        if (*length == capacity)
+        {
+            capacity = capacity ? capacity * 2 : REPLAY_INITIAL;
+            latencies = realloc(latencies, sizeof(*latencies) * capacity);
+            if (latencies == NULL) DIE("Failed to allocate latencies");
+        }
+        latencies[(*length)++] = record.latency;
+    }
+    if (ret < 0) DIE("Capture file %s is corrupt", path);
+    fclose(fp);
+    return latencies;
+}
+
+static void free_requests(replay_request* requests, size_t length)
+{
+    for (size_t i = 0; i < length; ++i)
+        free(requests[i].data);
+    free(requests);
+}
+
+/**
+ * \brief   Sends a single request to the daemon and waits for the whole reply.
+ *
+ * \return  0 on success, < 0 on error.
+ */
+static int send_request(unsigned int port, const replay_request* request)
+{
+    int socket_fd;
+    struct sockaddr_in socket_addr;
+    char buf[REPLAY_BUFLEN];
+    size_t sent = 0;
+    ssize_t len;
+    int ret = -1;
+
+    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) return -1;
+    socket_addr.sin_family = AF_INET;
+    socket_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socket_addr.sin_port = htons(port);
+    if (connect(socket_fd, (struct sockaddr*) &socket_addr, sizeof(socket_addr)) < 0)
+        goto exit;
+
+    while (sent < request->length)
+    {
+        len = send(socket_fd, request->data + sent, request->length - sent,
+                   MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) goto exit;
+        sent += len;
+    }
+
+    // The daemon closes the connection once the reply has been sent.
+    while ((len = recv(socket_fd, buf, REPLAY_BUFLEN, 0)) != 0)
+        if (len < 0 && errno != EINTR) goto exit;
+    ret = 0;
+
+exit:
+    close(socket_fd);
+    return ret;
+}
+
+static void* replay_routine(void* state_raw)
+{
+    replay_state* state = state_raw;
+    uint64_t first = state->requests[0].timestamp;
+    struct timespec due_ts;
+
+    for (;;)
+    {
+        size_t i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+        replay_request* request;
+        uint64_t due, sent;
+        if (i >= state->requests_length) break;
+        request = &state->requests[i];
+
+        // Wait until the request is due, relative to the first request.
+        due = state->start;
+        if (state->speed > 0)
+        {
+            due += (uint64_t) ((request->timestamp - first) / state->speed);
+            due_ts.tv_sec = due / 1000000000ull;
+            due_ts.tv_nsec = due % 1000000000ull;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due_ts, NULL) == EINTR) {}
+        }
+
+        sent = latency_now();
+        request->lag = state->speed > 0 && sent > due ? sent - due : 0;
+        request->failed = send_request(state->port, request) < 0;
+        request->replayed = latency_now() - sent;
+    }
+    return NULL;
+}
+
+/**
+ * \brief   Replays every request, spread over the given number of worker
+ *      threads so slow replies do not hold up later requests.
+ *
+ * \return  The time taken, in nanoseconds.
+ */
+static uint64_t replay(replay_request* requests, size_t length,
+                       unsigned int port, double speed, size_t workers)
+{
+    replay_state state;
+    pthread_t* threads;
+
+    state.requests = requests;
+    state.requests_length = length;
+    state.next = 0;
+    state.port = port;
+    state.speed = speed;
+    if (workers > length) workers = length;
+    threads = malloc(sizeof(*threads) * workers);
+    if (threads == NULL) DIE("Failed to allocate threads");
+
+    state.start = latency_now();
+    for (size_t i = 0; i < workers; ++i)
+        if (pthread_create(&threads[i], NULL, replay_routine, &state) != 0)
+            DIE("Failed to create replay thread");
+    for (size_t i = 0; i < workers; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    return latency_now() - state.start;
+}
+
+
+
+/*
+ * Output
+ */
+
+static void print_header(replay_format format)
+{
+    if (format == FORMAT_CSV)
+        printf("distribution,count,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,"
+               "p999_ns,max_ns\n");
+    else
+        printf("[\n");
+}
+
+static void print_summary(replay_format format, int first, const char* name,
+                          const latency_summary* s)
+{
+    if (format == FORMAT_CSV)
+    {
+        printf("%s,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+               ",%" PRIu64 ",%" PRIu64 "\n", name, s->count, s->mean, s->min,
+               s->p50, s->p90, s->p99, s->p999, s->max);
+    }
+    else
+    {
+        printf("%s  {\"distribution\": \"%s\", \"count\": %zu, \"mean_ns\": %"
+               PRIu64 ", \"min_ns\": %" PRIu64 ", \"p50_ns\": %" PRIu64
+               ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+               ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}",
+               first ? "" : ",\n", name, s->count, s->mean, s->min, s->p50,
+               s->p90, s->p99, s->p999, s->max);
+    }
+}
+
+/**
+ * \brief   Prints the difference between two summaries (b - a). Only
+ *      meaningful if both measure the same thing.
+ */
+static void print_change(replay_format format, const latency_summary* a,
+                         const latency_summary* b)
+{
+#define DIFF(field) ((int64_t) b->field - (int64_t) a->field)
+    if (format == FORMAT_CSV)
+    {
+        printf("change,%zu,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%"
+               PRId64 ",%" PRId64 ",%" PRId64 "\n", b->count, DIFF(mean),
+               DIFF(min), DIFF(p50), DIFF(p90), DIFF(p99), DIFF(p999),
+               DIFF(max));
+    }
+    else
+    {
+        printf(",\n  {\"distribution\": \"change\", \"count\": %zu, \"mean_ns\": %"
+               PRId64 ", \"min_ns\": %" PRId64 ", \"p50_ns\": %" PRId64
+               ", \"p90_ns\": %" PRId64 ", \"p99_ns\": %" PRId64
+               ", \"p999_ns\": %" PRId64 ", \"max_ns\": %" PRId64 "}",
+               b->count, DIFF(mean), DIFF(min), DIFF(p50), DIFF(p90),
+               DIFF(p99), DIFF(p999), DIFF(max));
+    }
+#undef DIFF
+}
+
+static void print_footer(replay_format format)
+{
+    if (format == FORMAT_JSON)
+        printf("\n]\n");
+}
+
+
+
+/*
+ * Functions
+ */
+
+/**
+ * \brief   Prints the program help text.
+ */
+void print_help(void)
+{
+    printf("Usage: replay [-h] [-d DAEMON_CAPTURE] [-f FORMAT] [-p PORT] "
+           "[-s SPEED]\n");
+    printf("              [-w WORKERS] CAPTURE_FILE\n");
+    printf("\n");
+    printf("Replays requests captured with 'acquired -c CAPTURE_FILE' against\n");
+    printf("the daemon, preserving their order and relative timing, and\n");
+    printf("reports the latency distributions. 'captured' is the daemon's time\n");
+    printf("from accepting each connection to sending its reply. 'replayed' is\n");
+    printf("measured by this client from connecting to the reply ending, so is\n");
+    printf("not comparable with it. To compare like with like, start the daemon\n");
+    printf("with 'acquired -c DAEMON_CAPTURE' and pass -d: the daemon's own\n");
+    printf("latencies for the replay are reported as 'replayed_daemon' along\n");
+    printf("with their 'change' from the captured ones.\n");
+    printf("\n");
+    printf("Positional arguments:\n");
+    printf("  CAPTURE_FILE  The capture file to replay.\n");
+    printf("\n");
+    printf("Optional arguments:\n");
+    printf("  -h    Show this help message and exit.\n");
+    printf("  -d    Capture file the daemon being replayed against is writing.\n");
+    printf("        It should see no other traffic during the replay.\n");
+    printf("  -f    Output format, 'csv' (default) or 'json'.\n");
+    printf("  -p    Port of the daemon to replay against (default: invoke\n");
+    printf("        ./acquired to find or start it).\n");
+    printf("  -s    Speed as a multiple of the captured rate, e.g. 2 for twice\n");
+    printf("        as fast, or 'max' to send as fast as possible (default 1).\n");
+    printf("  -w    Maximum requests in flight at once (default %d).\n",
+           DEFAULT_WORKERS);
+}
+
+/**
+ * \brief   Parses the command line arguments.
+ *
+ * \param opts  Pointer to the cl_opts structure to populate with arguments.
+ * \param argc  The number of passed arguments.
+ * \param argv  The passed argument array.
+ */
+void parse_command_line(cl_opts* opts, int argc, char* const argv[])
+{
+    int opt;
+    assert(opts);
+
+    // Set defaults.
+    opts->format = FORMAT_CSV;
+    opts->port = 0;
+    opts->speed = 1;
+    opts->workers = DEFAULT_WORKERS;
+    opts->daemon_capture_file = NULL;
+
+    // Parse optional arguments.
+    while ((opt = getopt(argc, argv, "hd:f:p:s:w:")) >= 0)
+    {
+        switch (opt)
+        {
+            case 'd': opts->daemon_capture_file = optarg; break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0) opts->format = FORMAT_CSV;
+                else if (strcmp(optarg, "json") == 0) opts->format = FORMAT_JSON;
+                else { print_help(); exit(1); }
+                break;
+            case 'p': opts->port = strtoul(optarg, NULL, 10); break;
+            case 's':
+                if (strcmp(optarg, "max") == 0) opts->speed = 0;
+                else if ((opts->speed = strtod(optarg, NULL)) <= 0)
+                {
+                    print_help();
+                    exit(1);
+                }
+                break;
+            case 'w': opts->workers = strtoul(optarg, NULL, 10); break;
+            case 'h': print_help(); exit(0); break;
+            default:  print_help(); exit(1); break;
+        }
+    }
+    if (opts->workers == 0) { print_help(); exit(1); }
+
+    // Parse positional arguments.
+    if (argc - optind != 1) { print_help(); exit(1); }
+    opts->capture_file = argv[optind];
+}
+
+/**
+ * \brief   Main.
+ */
+int main(int argc, char* const argv[])
+{
+    replay_request* requests;
+    size_t length, replayed = 0;
+    size_t daemon_length = 0;
+    uint64_t *captured_samples, *replayed_samples, *daemon_samples = NULL;
+    uint64_t elapsed, lag_max = 0;
+    long daemon_offset = 0;
+    latency_summary captured, replayed_summary, daemon_summary;
+
+    // Parse command line.
+    parse_command_line(&program_opts, argc, argv);
+
+    requests = load_requests(program_opts.capture_file, &length);
+    if (length == 0)
+    {
+        fprintf(stderr, "No requests in %s\n", program_opts.capture_file);
+        return 1;
+    }
+    if (program_opts.port == 0)
+        program_opts.port = get_daemon_port();
+    if (program_opts.daemon_capture_file)
+        daemon_offset = capture_end(program_opts.daemon_capture_file);
+
+    elapsed = replay(requests, length, program_opts.port, program_opts.speed,
+                     program_opts.workers);
+
+    // The daemon captures each request before closing its connection, so
+    // every reply has been captured by now.
+    if (program_opts.daemon_capture_file)
+    {
+        daemon_samples = load_latencies(program_opts.daemon_capture_file,
+                                        daemon_offset, &daemon_length);
+        latency_summarise(&daemon_summary, daemon_samples, daemon_length);
+    }
+
+    // Summarise the captured latencies and those replayed successfully.
+    captured_samples = malloc(sizeof(uint64_t) * length);
+    replayed_samples = malloc(sizeof(uint64_t) * length);
+    if (!captured_samples || !replayed_samples) DIE("Failed to allocate samples");
+    for (size_t i = 0; i < length; ++i)
+    {
+        captured_samples[i] = requests[i].captured;
+        if (requests[i].failed) continue;
+        replayed_samples[replayed++] = requests[i].replayed;
+        if (requests[i].lag > lag_max) lag_max = requests[i].lag;
+    }
+    latency_summarise(&captured, captured_samples, length);
+    latency_summarise(&replayed_summary, replayed_samples, replayed);
+
+    fprintf(stderr, "Replayed %zu requests (%zu failed) in %" PRIu64 "us, "
+            "latest start %" PRIu64 "us behind schedule\n", length,
+            length - replayed, elapsed / 1000, lag_max / 1000);
+    print_header(program_opts.format);
+    print_summary(program_opts.format, 1, "captured", &captured);
+    print_summary(program_opts.format, 0, "replayed", &replayed_summary);
+    if (program_opts.daemon_capture_file)
+    {
+        print_summary(program_opts.format, 0, "replayed_daemon", &daemon_summary);
+        print_change(program_opts.format, &captured, &daemon_summary);
+    }
+    print_footer(program_opts.format);
+
+    free(captured_samples);
+    free(replayed_samples);
+    free(daemon_samples);
+    free_requests(requests, length);
+    return replayed == length ? 0 : 1;
+}
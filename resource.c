@@ -0,0 +1,186 @@
+/**
+ * \file   resource.c
+ * \author Jonathan Simmonds
+ * \brief  Sharded table of named resources.
+ */
+#include <assert.h>     // assert
+#include <ctype.h>      // isalnum
+#include <pthread.h>    // pthread_rwlock_*, pthread_mutex_*
+#include <stdint.h>     // uint32_t
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, free, qsort
+#include <string.h>     // strncmp, strlen
+
+#include "resource.h"
+
+
+/**
+ * \brief   FNV-1a hash of a resource name.
+ */
+static uint32_t hash_name(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; ++name)
+    {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * \brief   Searches a bucket for a resource. The shard must be locked.
+ */
+static resource* find_in_bucket(resource* bucket, const char* name)
+{
+    for (; bucket; bucket = bucket->next)
+        if (strncmp(bucket->name, name, RESOURCE_NAMELEN) == 0)
+            return bucket;
+    return NULL;
+}
+
+int resource_table_create(resource_table* table, size_t shards)
+{
+    assert(table);
+    assert(shards > 0);
+
+    table->shards = calloc(shards, sizeof(resource_shard));
+    if (table->shards == NULL) return -1;
+    table->shards_length = shards;
+    for (size_t i = 0; i < shards; ++i)
+    {
+        if (pthread_rwlock_init(&table->shards[i].lock, NULL) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void resource_table_destroy(resource_table* table)
+{
+    assert(table);
+
+    for (size_t i = 0; i < table->shards_length; ++i)
+    {
+        resource_shard* shard = &table->shards[i];
+        for (size_t b = 0; b < RESOURCE_BUCKETS; ++b)
+        {
+            resource* res = shard->buckets[b];
+            while (res)
+            {
+                resource* next = res->next;
+                pthread_mutex_destroy(&res->lock);
+                free(res);
+                res = next;
+            }
+        }
+        pthread_rwlock_destroy(&shard->lock);
+    }
+    free(table->shards);
+    table->shards = NULL;
+    table->shards_length = 0;
+}
+
+int resource_name_valid(const char* name)
+{
+    size_t len = 0;
+    assert(name);
+
+    for (; name[len]; ++len)
+    {
+        char c = name[len];
+        if (len >= RESOURCE_NAMELEN - 1) return 0;
+        if (!isalnum((unsigned char) c) && c != '_' && c != '-' && c != '.')
+            return 0;
+    }
+    return len > 0;
+}
+
+resource* resource_lookup(resource_table* table, const char* name)
+{
+    uint32_t hash;
+    resource_shard* shard;
+    resource** bucket;
+    resource* res;
+    assert(table);
+    assert(name);
+
+    // The low bits pick the shard, the high bits pick the bucket within it.
+    hash = hash_name(name);
+    shard = &table->shards[hash % table->shards_length];
+    bucket = &shard->buckets[(hash >> 16) % RESOURCE_BUCKETS];
+
+    // Fast path: the resource already exists, which only needs a read lock.
+    if (pthread_rwlock_rdlock(&shard->lock) != 0) return NULL;
+    res = find_in_bucket(*bucket, name);
+    pthread_rwlock_unlock(&shard->lock);
+    if (res) return res;
+
+    // Slow path: create the resource. Another thread may have created it
+    // between dropping the read lock and taking the write lock, so search
+    // again.
+    if (pthread_rwlock_wrlock(&shard->lock) != 0) return NULL;
+    res = find_in_bucket(*bucket, name);
+    if (res == NULL)
+    {
+        res = calloc(1, sizeof(resource));
+        if (res && pthread_mutex_init(&res->lock, NULL) == 0)
+        {
+            snprintf(res->name, RESOURCE_NAMELEN, "%s", name);
+            res->next = *bucket;
+            *bucket = res;
+            shard->resources_length++;
+        }
+        else
+        {
+            free(res);
+            res = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return res;
+}
+
+static int compare_resources(const void* a_raw, const void* b_raw)
+{
+    const resource* a = *(resource* const*) a_raw;
+    const resource* b = *(resource* const*) b_raw;
+    return (a > b) - (a < b);
+}
+
+void resource_lock_all(resource** res, size_t length)
+{
+    assert(res);
+
+    qsort(res, length, sizeof(*res), compare_resources);
+    for (size_t i = 0; i < length; ++i)
+        if (i == 0 || res[i] != res[i - 1])
+            pthread_mutex_lock(&res[i]->lock);
+}
+
+void resource_unlock_all(resource** res, size_t length)
+{
+    assert(res);
+
+    for (size_t i = 0; i < length; ++i)
+        if (i == 0 || res[i] != res[i - 1])
+            pthread_mutex_unlock(&res[i]->lock);
+}
+
+unsigned long resource_read(resource* res, char* value, size_t valuelen)
+{
+    assert(res);
+    assert(value);
+
+    snprintf(value, valuelen, "%s", res->value);
+    return res->version;
+}
+
+unsigned long resource_write(resource* res, const char* value)
+{
+    assert(res);
+    assert(value);
+    assert(strlen(value) < RESOURCE_VALUELEN);
+
+    snprintf(res->value, RESOURCE_VALUELEN, "%s", value);
+    return ++res->version;
+}
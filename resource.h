@@ -0,0 +1,141 @@
+/**
+ * \file   resource.h
+ * \author Jonathan Simmonds
+ * \brief  Sharded table of named resources.
+ */
+#ifndef RESOURCE_H
+#define RESOURCE_H
+
+#include <pthread.h>    // pthread_mutex_t, pthread_rwlock_t
+#include <stddef.h>     // size_t
+
+#define RESOURCE_NAMELEN    64
+#define RESOURCE_VALUELEN   256
+#define RESOURCE_BUCKETS    64
+
+/**
+ * \brief   Structure representing a single named resource. Resources are owned
+ *      by the resource_table they were looked up in and live until it is
+ *      destroyed.
+ */
+typedef struct resource_t
+{
+    /** Name of the resource. NUL terminated. */
+    char name[RESOURCE_NAMELEN];
+    /** Protects all fields below. */
+    pthread_mutex_t lock;
+    /** Current value of the resource. NUL terminated. */
+    char value[RESOURCE_VALUELEN];
+    /** Number of times the resource has been written. */
+    unsigned long version;
+    /** Subscribers to notify when the resource changes. See notify.h. */
+    struct notify_link_t* subscribers;
+    /** Next resource in the same hash bucket. */
+    struct resource_t* next;
+} resource;
+
+/**
+ * \brief   Structure representing one shard of the resource table. Each shard
+ *      is independently locked so lookups on different shards never contend.
+ */
+typedef struct resource_shard_t
+{
+    /** Protects the buckets. Only write-locked to create a resource. */
+    pthread_rwlock_t lock;
+    /** Hash buckets of resources in this shard. */
+    resource* buckets[RESOURCE_BUCKETS];
+    /** Number of resources in this shard. */
+    size_t resources_length;
+} resource_shard;
+
+/**
+ * \brief   Structure representing a table of named resources. Initialise with
+ *      resource_table_create.
+ */
+typedef struct resource_table_t
+{
+    /** Array of shards. */
+    resource_shard* shards;
+    /** Size of the shards array. */
+    size_t shards_length;
+} resource_table;
+
+/**
+ * \brief   Creates a resource table, initialising a resource_table struct.
+ *
+ * \param table     The resource_table struct to initialise.
+ * \param shards    The number of independently locked shards. > 0.
+ * \return  0 on success, < 0 on error.
+ */
+int resource_table_create(resource_table* table, size_t shards);
+
+/**
+ * \brief   Destroys a resource table and every resource in it. Accesses to the
+ *      table or any resource looked up from it after calling this function
+ *      are undefined.
+ *
+ * \param table The initialised resource_table to destroy.
+ */
+void resource_table_destroy(resource_table* table);
+
+/**
+ * \brief   Determines whether a string is a valid resource name.
+ *
+ * \param name  The name to check. Not NULL.
+ * \return  1 if the name is valid, 0 otherwise.
+ */
+int resource_name_valid(const char* name);
+
+/**
+ * \brief   Finds the named resource, creating it if this is the first access.
+ *      This function is thread safe.
+ *
+ * \param table The initialised resource_table to search.
+ * \param name  The name of the resource. Must be valid per
+ *      resource_name_valid.
+ * \return  Pointer to the resource, valid until the table is destroyed. NULL
+ *      on error.
+ */
+resource* resource_lookup(resource_table* table, const char* name);
+
+/**
+ * \brief   Locks a set of resources. Resources are locked in a consistent
+ *      (address) order so concurrent callers locking overlapping sets cannot
+ *      deadlock.
+ *
+ * \param res       Array of resources to lock. Sorted in place. Duplicates are
+ *      permitted and only locked once. Not NULL.
+ * \param length    Length of the res array.
+ */
+void resource_lock_all(resource** res, size_t length);
+
+/**
+ * \brief   Unlocks a set of resources previously locked with
+ *      resource_lock_all.
+ *
+ * \param res       Array of resources passed to resource_lock_all. Not NULL.
+ * \param length    Length of the res array.
+ */
+void resource_unlock_all(resource** res, size_t length);
+
+/**
+ * \brief   Reads a resource's value. The resource must be locked.
+ *
+ * \param res       The resource to read. Not NULL.
+ * \param value     Buffer to copy the value into. Not NULL.
+ * \param valuelen  Length of the value buffer.
+ * \return  The version of the value which was read.
+ */
+unsigned long resource_read(resource* res, char* value, size_t valuelen);
+
+/**
+ * \brief   Writes a resource's value. The resource must be locked.
+ *
+ * \param res   The resource to write. Not NULL.
+ * \param value The new value. Not NULL. Must be shorter than
+ *      RESOURCE_VALUELEN.
+ * \return  The version of the newly written value.
+ */
+unsigned long resource_write(resource* res, const char* value);
+
+#endif // RESOURCE_H
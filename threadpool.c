@@ -4,11 +4,13 @@
  * \brief  Basic thread pool implementation with pthreads.
  */
 #include <assert.h> // assert
-#include <pthread.h> // pthread_create, pthread_self, pthread_equal
-#include <stdlib.h> // malloc
+#include <errno.h> // ETIMEDOUT
+#include <pthread.h> // pthread_create, pthread_attr_*, pthread_mutex_*,
+                     // pthread_cond_*
+#include <stdlib.h> // malloc, realloc, free
 #include <stdio.h> // fprintf, stderr, perror
-#include <sys/types.h> // pthread_t
-#include <semaphore.h> // sem_init, sem_destroy, sem_wait, sem_post, sem_getvalue
+#include <string.h> // memset
+#include <time.h> // clock_gettime
 
 #include "threadpool.h"
 
@@ -20,22 +22,277 @@
     perror(__func__); \
     exit(1); \
 }
+#define NO_DEADLINE     UINT64_MAX
+#define STARVATION_NS   ((uint64_t) THREADPOOL_STARVATION_MS * 1000000)
+#define QUEUE_INITIAL   16
+#define IDLE_NS         ((uint64_t) THREADPOOL_IDLE_MS * 1000000)
+#define SHRINK_DELAY_NS ((uint64_t) THREADPOOL_SHRINK_DELAY_MS * 1000000)
+
+
+uint64_t threadpool_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * Queue (min-heap on deadline, then sequence number) helpers. All must be
+ * called with the pool locked.
+ */
+
+static int task_before(const struct threadpool_task_t* a,
+                       const struct threadpool_task_t* b)
+{
+    if (a->deadline != b->deadline) return a->deadline < b->deadline;
+    return a->seq < b->seq;
+}
+
+static int queue_push(struct threadpool_queue_t* queue,
+                      const struct threadpool_task_t* task)
+{
+    size_t i;
+    if (queue->tasks_length == queue->tasks_capacity)
+    {
+        size_t capacity = queue->tasks_capacity ? queue->tasks_capacity * 2
+                                                : QUEUE_INITIAL;
+        struct threadpool_task_t* tasks =
+            realloc(queue->tasks, sizeof(*tasks) * capacity);
+        if (tasks == NULL) return -1;
+        queue->tasks = tasks;
+        queue->tasks_capacity = capacity;
+    }
+
+    // Sift up.
+    i = queue->tasks_length++;
+    while (i > 0 && task_before(task, &queue->tasks[(i - 1) / 2]))
+    {
+        queue->tasks[i] = queue->tasks[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->tasks[i] = *task;
+    return 0;
+}
+
+static void queue_pop(struct threadpool_queue_t* queue,
+                      struct threadpool_task_t* task)
+{
+    struct threadpool_task_t last;
+    size_t i = 0;
+    assert(queue->tasks_length > 0);
+
+    *task = queue->tasks[0];
+    last = queue->tasks[--queue->tasks_length];
+
+    // Sift down.
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= queue->tasks_length) break;
+        if (child + 1 < queue->tasks_length &&
+            task_before(&queue->tasks[child + 1], &queue->tasks[child]))
+            ++child;
+        if (!task_before(&queue->tasks[child], &last)) break;
+        queue->tasks[i] = queue->tasks[child];
+        i = child;
+    }
+    queue->tasks[i] = last;
+}
+
+/**
+ * \brief   Picks the next queued task to start. Starved classes are served
+ *      first (longest starved first), otherwise the highest priority non-empty
+ *      class. Must be called with the pool locked.
+ *
+ * \return  The priority class of the popped task, < 0 if nothing is queued.
+ */
+static int pick_task(threadpool* pool, uint64_t now,
+                     struct threadpool_task_t* task)
+{
+    int chosen = -1;
+    int starved = -1;
+    uint64_t starved_for = 0;
+
+    for (int p = 0; p < THREADPOOL_PRIORITIES; ++p)
+    {
+        struct threadpool_queue_t* queue = &pool->queues[p];
+        if (queue->tasks_length == 0) continue;
+        if (chosen < 0) chosen = p;
+        if (now - queue->last_served > STARVATION_NS &&
+            now - queue->last_served > starved_for)
+        {
+            starved = p;
+            starved_for = now - queue->last_served;
+        }
+    }
+    if (chosen < 0) return -1;
+    if (starved > chosen)
+    {
+        pool->stats[starved].starvation_promotions++;
+        chosen = starved;
+    }
+
+    queue_pop(&pool->queues[chosen], task);
+    pool->queues[chosen].last_served = now;
+    return chosen;
+}
+
+/**
+ * \brief   Records a task starting in the scheduling statistics. Must be
+ *      called with the pool locked.
+ */
+static void record_start(threadpool* pool, int priority,
+                         const struct threadpool_task_t* task, uint64_t now)
+{
+    threadpool_stats* stats = &pool->stats[priority];
+    uint64_t wait = now - task->dispatched;
+    stats->started++;
+    stats->wait_total += wait;
+    if (wait > stats->wait_max) stats->wait_max = wait;
+    if (now > task->deadline) stats->deadlines_missed++;
+}
+
+
+/**
+ * \brief   Counts the tasks queued across every priority class. Must be called
+ *      with the pool locked.
+ */
+static size_t queued_tasks(threadpool* pool)
+{
+    size_t queued = 0;
+    for (int p = 0; p < THREADPOOL_PRIORITIES; ++p)
+        queued += pool->queues[p].tasks_length;
+    return queued;
+}
+
+/**
+ * \brief   Starts a worker thread. Must be called with the pool locked.
+ *
+ * \return  0 on success, < 0 on error.
+ */
+static int spawn_worker(threadpool* pool);
+
+/**
+ * \brief   Determines whether an idle worker thread should retire: the pool is
+ *      above its minimum and hasn't grown recently. Must be called with the
+ *      pool locked.
+ */
+static int should_retire(threadpool* pool, uint64_t now)
+{
+    return pool->threads_length > pool->threads_min &&
+        now - pool->last_grown > SHRINK_DELAY_NS;
+}
+
+static void* internal_dispatch(void* pool_raw)
+{
+    threadpool* pool = (threadpool*) pool_raw;
+    struct threadpool_task_t task;
+    struct timespec idle_deadline;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running)
+    {
+        uint64_t now = threadpool_now();
+        int priority = pick_task(pool, now, &task);
+        if (priority >= 0)
+        {
+            // Actually run the thread routine.
+            record_start(pool, priority, &task, now);
+            pool->threads_busy++;
+            pthread_mutex_unlock(&pool->lock);
+            task.routine(task.arg);
+            pthread_mutex_lock(&pool->lock);
+            pool->threads_busy--;
+            continue;
+        }
+
+        // Nothing queued, wait for a routine. Threads above the minimum retire
+        // once they have been idle for long enough.
+        now += IDLE_NS;
+        idle_deadline.tv_sec = now / 1000000000ull;
+        idle_deadline.tv_nsec = now % 1000000000ull;
+        pool->threads_idle++;
+        ret = pthread_cond_timedwait(&pool->work, &pool->lock, &idle_deadline);
+        pool->threads_idle--;
+        if (ret == ETIMEDOUT && queued_tasks(pool) == 0 &&
+            should_retire(pool, threadpool_now()))
+        {
+            pool->thread_stats.retired++;
+            break;
+        }
+    }
+
+    pool->threads_length--;
+    pthread_cond_broadcast(&pool->exited);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int spawn_worker(threadpool* pool)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, &pool->attr, internal_dispatch, pool) != 0)
+        return -1;
+    pool->threads_length++;
+    pool->thread_stats.spawned++;
+    if (pool->threads_length > pool->thread_stats.peak)
+        pool->thread_stats.peak = pool->threads_length;
+    return 0;
+}
 
 
 int threadpool_create(threadpool* pool, size_t size)
 {
+    return threadpool_create_elastic(pool, size, size, 0);
+}
+
+int threadpool_create_elastic(threadpool* pool, size_t min_size,
+                              size_t max_size, size_t stack_size)
+{
+    pthread_condattr_t condattr;
     assert(pool);
+    assert(max_size > 0 && min_size <= max_size);
+
+    pool->threads_min = min_size;
+    pool->threads_max = max_size;
+    pool->running = 1;
+    pool->threads_length = 0;
+    pool->threads_busy = 0;
+    pool->threads_idle = 0;
+    pool->last_grown = threadpool_now();
+    pool->seq = 0;
+    memset(&pool->thread_stats, 0, sizeof(pool->thread_stats));
+    memset(pool->queues, 0, sizeof(pool->queues));
+    memset(pool->stats, 0, sizeof(pool->stats));
+
+    // Worker threads are never joined, create them detached so their
+    // resources are reclaimed on exit.
+    if (pthread_attr_init(&pool->attr) != 0) return -1;
+    pthread_attr_setdetachstate(&pool->attr, PTHREAD_CREATE_DETACHED);
+    if (stack_size && pthread_attr_setstacksize(&pool->attr, stack_size) != 0)
+        return -1;
+    pthread_attr_getstacksize(&pool->attr, &pool->thread_stats.stack_size);
 
-    pool->threads = malloc(sizeof(struct thread_t) * size);
-    if (pool->threads == NULL) return -1;
-    pool->threads_length = size;
-    for (size_t i = 0; i < size; ++i)
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) return -1;
+    if (pthread_condattr_init(&condattr) != 0) return -1;
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&pool->work, &condattr) != 0) return -1;
+    pthread_condattr_destroy(&condattr);
+    if (pthread_cond_init(&pool->exited, NULL) != 0) return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < min_size; ++i)
     {
-        pool->threads[i].pool = pool;
-        pool->threads[i].routine = NULL;
-        pool->threads[i].arg = NULL;
+        if (spawn_worker(pool) < 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            threadpool_destroy(pool);
+            return -1;
+        }
     }
-    return sem_init(&pool->threads_free, 0, size);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
 }
 
 void threadpool_destroy(threadpool* pool)
@@ -44,55 +301,83 @@ void threadpool_destroy(threadpool* pool)
     // threadpool was created to ensure mutual exclusion.
     assert(pool);
 
-    free(pool->threads);
-    pool->threads = NULL;
-    pool->threads_length = 0;
-    sem_destroy(&pool->threads_free);
-}
+    pthread_mutex_lock(&pool->lock);
+    pool->running = 0;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->threads_length > 0)
+        pthread_cond_wait(&pool->exited, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
 
+    for (int p = 0; p < THREADPOOL_PRIORITIES; ++p)
+    {
+        free(pool->queues[p].tasks);
+        pool->queues[p].tasks = NULL;
+        pool->queues[p].tasks_length = 0;
+        pool->queues[p].tasks_capacity = 0;
+    }
+    pthread_cond_destroy(&pool->exited);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_attr_destroy(&pool->attr);
+}
 
-void* internal_dispatch(void* thread_raw)
+int threadpool_dispatch(threadpool* pool, void (*routine)(void*), void* arg)
 {
-    struct thread_t* thread = (struct thread_t*) thread_raw;
-
-    // Actually run the thread routine.
-    thread->routine(thread->arg);
-
-    // Clean up the thread table to mark the slot as free.
-    thread->routine = NULL;
-    thread->arg = NULL;
- 
-    // Increment the free-slot semaphore.
-    sem_post(&thread->pool->threads_free);
-    return NULL;
+    return threadpool_dispatch_sched(pool, routine, arg,
+                                     THREADPOOL_PRIORITY_NORMAL, 0);
 }
 
-int threadpool_dispatch(threadpool* pool, void (*routine)(void*), void* arg)
+int threadpool_dispatch_sched(threadpool* pool, void (*routine)(void*),
+                              void* arg, threadpool_priority priority,
+                              uint64_t deadline)
 {
-    // The dispatch method must always be called on the same thread the
-    // threadpool was created to ensure mutual exclusion.
-    int slot = -1;
+    struct threadpool_task_t task;
+    struct threadpool_queue_t* queue;
     assert(pool);
+    assert(routine);
+    assert(priority >= 0 && priority < THREADPOOL_PRIORITIES);
+
+    task.routine = routine;
+    task.arg = arg;
+    task.deadline = deadline ? deadline : NO_DEADLINE;
+    task.dispatched = threadpool_now();
+
+    pthread_mutex_lock(&pool->lock);
+    task.seq = pool->seq++;
 
-    // Reserve an empty slot.
-    if (sem_wait(&pool->threads_free) != 0) return -1;
-    for (int i = 0; i < pool->threads_length; ++i)
+    // A pool with no minimum may have shrunk to nothing. Spawn a worker before
+    // queueing the routine, so a failure leaves nothing queued which will
+    // never run (or run after the caller has cleaned up after it).
+    if (pool->threads_length == 0)
     {
-        if (pool->threads[i].routine == NULL)
+        if (spawn_worker(pool) < 0)
         {
-            slot = i;
-            break;
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
         }
+        pool->last_grown = task.dispatched;
     }
-    if (slot < 0) return -2;
 
-    // Setup the thread table.
-    pool->threads[slot].routine = routine;
-    pool->threads[slot].arg = arg;
+    // Queue the routine for the next free worker thread.
+    queue = &pool->queues[priority];
+    if (queue->tasks_length == 0) queue->last_served = task.dispatched;
+    if (queue_push(queue, &task) < 0)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
 
-    // Dispatch the thread.
-    return pthread_create(&(pool->threads[slot].thread), NULL,
-        internal_dispatch, &pool->threads[slot]);
+    // Wake an idle worker. If there are more routines queued than idle
+    // workers to take them, grow the pool.
+    pthread_cond_signal(&pool->work);
+    if (queued_tasks(pool) > pool->threads_idle &&
+        pool->threads_length < pool->threads_max)
+    {
+        if (spawn_worker(pool) == 0)
+            pool->last_grown = task.dispatched;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
 }
 
 int threadpool_active_threads(threadpool* pool)
@@ -100,8 +385,37 @@ int threadpool_active_threads(threadpool* pool)
     int active_threads;
     assert(pool);
 
-    if (sem_getvalue(&pool->threads_free, &active_threads) != 0) return -1;
-    // active_threads may be < 0 if there are threads blocked waiting on the
-    // semaphore. In this case the returned value will exceed threads_length.
-    return pool->threads_length - active_threads;
+    pthread_mutex_lock(&pool->lock);
+    active_threads = pool->threads_busy;
+    for (int p = 0; p < THREADPOOL_PRIORITIES; ++p)
+        active_threads += pool->queues[p].tasks_length;
+    pthread_mutex_unlock(&pool->lock);
+    return active_threads;
+}
+
+void threadpool_get_stats(threadpool* pool, threadpool_stats* stats)
+{
+    assert(pool);
+    assert(stats);
+
+    pthread_mutex_lock(&pool->lock);
+    for (int p = 0; p < THREADPOOL_PRIORITIES; ++p)
+    {
+        stats[p] = pool->stats[p];
+        stats[p].queued = pool->queues[p].tasks_length;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_get_thread_stats(threadpool* pool,
+                                 threadpool_thread_stats* stats)
+{
+    assert(pool);
+    assert(stats);
+
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->thread_stats;
+    stats->threads = pool->threads_length;
+    stats->idle = pool->threads_idle;
+    pthread_mutex_unlock(&pool->lock);
 }
@@ -6,34 +6,141 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <sys/types.h> // pthread_t
-#include <semaphore.h> // sem_t
+#include <pthread.h>    // pthread_t, pthread_mutex_t
+#include <stdint.h>     // uint64_t
+#include <sys/types.h>  // size_t
 
+/** Number of priority classes. */
+#define THREADPOOL_PRIORITIES   3
+/** A queued class which has not been served for this long is served ahead of
+ *  higher priority classes. */
+#define THREADPOOL_STARVATION_MS 100
+/** A thread above the pool's minimum which has been idle for this long
+ *  retires. */
+#define THREADPOOL_IDLE_MS      2000
+/** No thread retires until this long after the pool last grew, so the pool
+ *  does not oscillate under bursty load. */
+#define THREADPOOL_SHRINK_DELAY_MS 5000
 
-struct thread_t
+/**
+ * \brief   Priority classes, in decreasing order of priority.
+ */
+typedef enum threadpool_priority_t
+{
+    THREADPOOL_PRIORITY_HIGH   = 0,
+    THREADPOOL_PRIORITY_NORMAL = 1,
+    THREADPOOL_PRIORITY_LOW    = 2,
+} threadpool_priority;
+
+struct threadpool_task_t
 {
-    struct threadpool_t* pool;
-    pthread_t thread;
     void (*routine)(void*);
     void* arg;
+    /** Absolute monotonic deadline in nanoseconds, UINT64_MAX if none. */
+    uint64_t deadline;
+    /** Monotonic time the task was dispatched, in nanoseconds. */
+    uint64_t dispatched;
+    /** Dispatch sequence number, orders tasks with equal deadlines. */
+    uint64_t seq;
+};
+
+/**
+ * \brief   Min-heap of tasks waiting for a thread, ordered by deadline.
+ */
+struct threadpool_queue_t
+{
+    struct threadpool_task_t* tasks;
+    size_t tasks_length;
+    size_t tasks_capacity;
+    /** Monotonic time this class last had a task started, or became
+     *  non-empty, in nanoseconds. */
+    uint64_t last_served;
 };
 
 /**
- * \brief   Structure representing a thread pool. Only threads_length should be
- *      interacted with by clients. Initialise with threadpool_create.
+ * \brief   Per-priority class scheduling statistics.
+ */
+typedef struct threadpool_stats_t
+{
+    /** Number of tasks started. */
+    unsigned long started;
+    /** Number of tasks currently waiting for a thread. */
+    unsigned long queued;
+    /** Total time started tasks spent waiting for a thread, in nanoseconds. */
+    uint64_t wait_total;
+    /** Longest time a started task spent waiting for a thread, in
+     *  nanoseconds. */
+    uint64_t wait_max;
+    /** Number of tasks started after their deadline had passed. */
+    unsigned long deadlines_missed;
+    /** Number of tasks started ahead of higher priority classes to avoid
+     *  starvation. */
+    unsigned long starvation_promotions;
+} threadpool_stats;
+
+/**
+ * \brief   Thread statistics for the whole pool.
+ */
+typedef struct threadpool_thread_stats_t
+{
+    /** Current number of worker threads. */
+    size_t threads;
+    /** Number of worker threads currently waiting for a routine. */
+    size_t idle;
+    /** Largest number of worker threads there have ever been. */
+    size_t peak;
+    /** Number of worker threads started. */
+    unsigned long spawned;
+    /** Number of worker threads retired for being idle. */
+    unsigned long retired;
+    /** Stack size of each worker thread, in bytes. */
+    size_t stack_size;
+} threadpool_thread_stats;
+
+/**
+ * \brief   Structure representing a thread pool of worker threads which grows
+ *      when routines are queued faster than idle workers can take them, up to
+ *      threads_max, and shrinks back to threads_min as workers go idle. Only
+ *      threads_min and threads_max should be interacted with by clients.
+ *      Initialise with threadpool_create or threadpool_create_elastic.
  */
 typedef struct threadpool_t
 {
-    /** Array of thread workers. */
-    struct thread_t* threads;
-    /** Size of the threads array. */
+    /** Number of worker threads which are never retired. */
+    size_t threads_min;
+    /** Maximum number of simultaneous worker threads. */
+    size_t threads_max;
+    /** Attributes worker threads are created with. */
+    pthread_attr_t attr;
+    /** Protects all fields below. */
+    pthread_mutex_t lock;
+    /** Signalled when a routine is queued or the pool is destroyed. */
+    pthread_cond_t work;
+    /** Signalled when a worker thread exits. */
+    pthread_cond_t exited;
+    /** Non-zero until the pool is destroyed. */
+    int running;
+    /** Current number of worker threads. */
     size_t threads_length;
-    /** Current number of thread worker slots not in use (i.e. free). */
-    sem_t threads_free;
+    /** Current number of worker threads running a routine. */
+    size_t threads_busy;
+    /** Current number of worker threads waiting for a routine. */
+    size_t threads_idle;
+    /** Monotonic time the pool last grew, in nanoseconds. */
+    uint64_t last_grown;
+    /** Thread statistics. */
+    threadpool_thread_stats thread_stats;
+    /** Tasks waiting for a thread, one queue per priority class. */
+    struct threadpool_queue_t queues[THREADPOOL_PRIORITIES];
+    /** Next dispatch sequence number. */
+    uint64_t seq;
+    /** Scheduling statistics, one per priority class. */
+    threadpool_stats stats[THREADPOOL_PRIORITIES];
 } threadpool;
 
 /**
- * \brief   Creates a thread pool, initialising a threadpool struct.
+ * \brief   Creates a fixed size thread pool, initialising a threadpool struct.
+ *      Equivalent to threadpool_create_elastic(pool, size, size, 0).
  *
  * \param pool  The threadpool struct to initialise.
  * \param size  The number of simultaneous threads which may run in the
@@ -43,9 +150,26 @@ typedef struct threadpool_t
 int threadpool_create(threadpool* pool, size_t size);
 
 /**
- * \brief   Destroys a thread pool. This must be called on the same thread the
- *      threadpool was created. Accesses to the threadpool after calling this
- *      function are undefined.
+ * \brief   Creates a thread pool which grows and shrinks with load,
+ *      initialising a threadpool struct. min_size worker threads are started
+ *      immediately.
+ *
+ * \param pool          The threadpool struct to initialise.
+ * \param min_size      The number of worker threads kept even when idle.
+ * \param max_size      The number of simultaneous threads which may run in
+ *      the threadpool. >= min_size and > 0.
+ * \param stack_size    Stack size of each worker thread in bytes, 0 for the
+ *      system default.
+ * \return  0 on success, < 0 on error.
+ */
+int threadpool_create_elastic(threadpool* pool, size_t min_size,
+                              size_t max_size, size_t stack_size);
+
+/**
+ * \brief   Destroys a thread pool, waiting for every worker thread to exit.
+ *      Routines which are still queued are discarded. This must be called on
+ *      the same thread the threadpool was created. Accesses to the threadpool
+ *      after calling this function are undefined.
  *
  * \param pool  The initialised threadpool to destroy.
  */
@@ -53,9 +177,8 @@ void threadpool_destroy(threadpool* pool);
 
 /**
  * \brief   Dispatches a thread in the threadpool to execute the given routine
- *      with the given argument. If no thread in the pool is currently available
- *      to dispatch to, this function will block until one is ready. This must
- *      be called on the same thread the threadpool was created.
+ *      with the given argument at normal priority and with no deadline. See
+ *      threadpool_dispatch_sched.
  *
  * \param pool      The initialised threadpool to dispatch to.
  * \param routine   Pointer to the function to execute on a separate thread. Not
@@ -66,14 +189,63 @@ void threadpool_destroy(threadpool* pool);
  */
 int threadpool_dispatch(threadpool* pool, void (*routine)(void*), void* arg);
 
+/**
+ * \brief   Dispatches a thread in the threadpool to execute the given routine
+ *      with the given argument. If no thread in the pool is currently available
+ *      the routine is queued and this function returns immediately. Queued
+ *      routines are started highest priority class first and, within a class,
+ *      earliest deadline first (routines without a deadline go last, in
+ *      dispatch order). A class which has been waiting for longer than
+ *      THREADPOOL_STARVATION_MS is served ahead of higher classes.
+ *
+ * \param pool      The initialised threadpool to dispatch to.
+ * \param routine   Pointer to the function to execute on a separate thread. Not
+ *      NULL. On return the thread will be returned to the pool.
+ * \param arg       Argument to pass to routine. May be NULL. If multiple
+ *      arguments are needed this should be a pointer to a struct.
+ * \param priority  Priority class of the routine.
+ * \param deadline  Absolute CLOCK_MONOTONIC deadline by which the routine
+ *      should start, in nanoseconds. 0 for no deadline.
+ * \return  0 on success, < 0 on error, in which case the routine will never
+ *      be run.
+ */
+int threadpool_dispatch_sched(threadpool* pool, void (*routine)(void*),
+                              void* arg, threadpool_priority priority,
+                              uint64_t deadline);
+
 /**
  * \brief   Counts the number of active threads in the threadpool (i.e. threads
  *      which have been dispatched and not yet terminated).
  *
  * \param pool  The initialised threadpool whose state to query.
- * \return  The number of active threads (which may exceed pool->threads_length
- *      if there are threads waiting to dispatch). < 0 on error.
+ * \return  The number of active threads (which may exceed pool->threads_max if
+ *      there are routines queued waiting for a thread). < 0 on error.
  */
 int threadpool_active_threads(threadpool* pool);
 
-#endif // THREADPOOL_H
\ No newline at end of file
+/**
+ * \brief   Copies the threadpool's per-priority class scheduling statistics.
+ *
+ * \param pool  The initialised threadpool whose state to query.
+ * \param stats Array of THREADPOOL_PRIORITIES stats structs to populate,
+ *      indexed by threadpool_priority. Not NULL.
+ */
+void threadpool_get_stats(threadpool* pool, threadpool_stats* stats);
+
+/**
+ * \brief   Copies the threadpool's thread statistics.
+ *
+ * \param pool  The initialised threadpool whose state to query.
+ * \param stats The stats struct to populate. Not NULL.
+ */
+void threadpool_get_thread_stats(threadpool* pool,
+                                 threadpool_thread_stats* stats);
+
+/**
+ * \brief   Reads the clock threadpool deadlines are measured against.
+ *
+ * \return  The current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t threadpool_now(void);
+
+#endif // THREADPOOL_H
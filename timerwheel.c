@@ -0,0 +1,204 @@
+/**
+ * \file   timerwheel.c
+ * \author Jonathan Simmonds
+ * \brief  Hierarchical timing wheel for cheaply tracking many timeouts.
+ */
+#include <assert.h>     // assert
+#include <errno.h>      // EINTR
+#include <pthread.h>    // pthread_create, pthread_join, pthread_mutex_*
+#include <string.h>     // memset
+#include <time.h>       // clock_gettime, clock_nanosleep
+
+#include "timerwheel.h"
+
+
+#define SLOT_MASK   (TIMERWHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) (TIMERWHEEL_SLOT_BITS * (level))
+#define MAX_DELTA   ((1ull << LEVEL_SHIFT(TIMERWHEEL_LEVELS)) - 1)
+
+
+static uint64_t monotonic_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * Slot list helpers. All must be called with the wheel locked.
+ */
+
+static void unlink_timer(wheel_timer* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * \brief   Places a timer in the slot matching its expiry: the finest level
+ *      whose span covers the time remaining.
+ */
+static void insert_timer(timerwheel* wheel, wheel_timer* timer)
+{
+    uint64_t delta;
+    int level;
+    wheel_timer** slot;
+
+    if (timer->expires <= wheel->now) timer->expires = wheel->now + 1;
+    delta = timer->expires - wheel->now;
+    if (delta > MAX_DELTA)
+    {
+        timer->expires = wheel->now + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+    for (level = 0; level < TIMERWHEEL_LEVELS - 1; ++level)
+        if (delta < (1ull << LEVEL_SHIFT(level + 1))) break;
+
+    slot = &wheel->slots[level][(timer->expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    timer->next = *slot;
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/**
+ * \brief   Moves every timer in a slot down to a finer level.
+ */
+static void cascade(timerwheel* wheel, int level, size_t index)
+{
+    wheel_timer* timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer)
+    {
+        wheel_timer* next = timer->next;
+        insert_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * \brief   Advances the wheel by one tick, cascading coarser levels as their
+ *      slots come due and running every timer which expires on this tick.
+ */
+static void tick(timerwheel* wheel)
+{
+    wheel_timer** slot;
+
+    wheel->now++;
+    for (int level = 1; level < TIMERWHEEL_LEVELS; ++level)
+    {
+        if ((wheel->now & ((1ull << LEVEL_SHIFT(level)) - 1)) != 0) break;
+        cascade(wheel, level, (wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK);
+    }
+
+    slot = &wheel->slots[0][wheel->now & SLOT_MASK];
+    while (*slot)
+    {
+        wheel_timer* timer = *slot;
+        unlink_timer(timer);
+        wheel->expired++;
+        timer->callback(timer->arg);
+    }
+}
+
+static void* run_wheel(void* wheel_raw)
+{
+    timerwheel* wheel = wheel_raw;
+    struct timespec next;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->running)
+    {
+        uint64_t wake = wheel->start + (wheel->now + 1) * wheel->tick_ns;
+        pthread_mutex_unlock(&wheel->lock);
+
+        next.tv_sec = wake / 1000000000ull;
+        next.tv_nsec = wake % 1000000000ull;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+
+        // Catch up on every tick which has passed (more than one if this
+        // thread was descheduled).
+        pthread_mutex_lock(&wheel->lock);
+        uint64_t target = (monotonic_now() - wheel->start) / wheel->tick_ns;
+        while (wheel->running && wheel->now < target)
+            tick(wheel);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return NULL;
+}
+
+
+void wheel_timer_init(wheel_timer* timer)
+{
+    assert(timer);
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = NULL;
+    timer->arg = NULL;
+}
+
+int timerwheel_create(timerwheel* wheel, unsigned int tick_ms)
+{
+    assert(wheel);
+    assert(tick_ms > 0);
+
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->tick_ns = (uint64_t) tick_ms * 1000000;
+    wheel->start = monotonic_now();
+    wheel->now = 0;
+    wheel->expired = 0;
+    wheel->running = 1;
+    if (pthread_mutex_init(&wheel->lock, NULL) != 0) return -1;
+    if (pthread_create(&wheel->thread, NULL, run_wheel, wheel) != 0)
+    {
+        pthread_mutex_destroy(&wheel->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void timerwheel_destroy(timerwheel* wheel)
+{
+    assert(wheel);
+
+    pthread_mutex_lock(&wheel->lock);
+    wheel->running = 0;
+    pthread_mutex_unlock(&wheel->lock);
+    pthread_join(wheel->thread, NULL);
+    pthread_mutex_destroy(&wheel->lock);
+}
+
+void timerwheel_arm(timerwheel* wheel, wheel_timer* timer,
+                    unsigned int timeout_ms, void (*callback)(void*),
+                    void* arg)
+{
+    uint64_t expires_ns;
+    assert(wheel);
+    assert(timer);
+    assert(callback);
+
+    expires_ns = monotonic_now() + (uint64_t) timeout_ms * 1000000;
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->pprev) unlink_timer(timer);
+    timer->expires = (expires_ns - wheel->start + wheel->tick_ns - 1) / wheel->tick_ns;
+    timer->callback = callback;
+    timer->arg = arg;
+    insert_timer(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+int timerwheel_cancel(timerwheel* wheel, wheel_timer* timer)
+{
+    int armed;
+    assert(wheel);
+    assert(timer);
+
+    pthread_mutex_lock(&wheel->lock);
+    armed = timer->pprev != NULL;
+    if (armed) unlink_timer(timer);
+    pthread_mutex_unlock(&wheel->lock);
+    return armed;
+}
@@ -0,0 +1,113 @@
+/**
+ * \file   timerwheel.h
+ * \author Jonathan Simmonds
+ * \brief  Hierarchical timing wheel for cheaply tracking many timeouts.
+ */
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <pthread.h>    // pthread_t, pthread_mutex_t
+#include <stdint.h>     // uint64_t
+
+#define TIMERWHEEL_LEVELS       4
+#define TIMERWHEEL_SLOT_BITS    6
+#define TIMERWHEEL_SLOTS        (1 << TIMERWHEEL_SLOT_BITS)
+
+/**
+ * \brief   Structure representing a single timer. Timers are intrusive: the
+ *      caller owns the memory, which must remain valid while the timer is
+ *      armed. Initialise with wheel_timer_init.
+ */
+typedef struct wheel_timer_t
+{
+    /** Next timer in the same slot. */
+    struct wheel_timer_t* next;
+    /** Pointer to the pointer to this timer in its slot, NULL if not armed. */
+    struct wheel_timer_t** pprev;
+    /** Tick at which the timer expires. */
+    uint64_t expires;
+    /** Function called when the timer expires. */
+    void (*callback)(void*);
+    /** Argument passed to callback. */
+    void* arg;
+} wheel_timer;
+
+/**
+ * \brief   Structure representing a timing wheel. Timers are held in one of
+ *      TIMERWHEEL_LEVELS wheels of TIMERWHEEL_SLOTS slots each, every level
+ *      TIMERWHEEL_SLOTS times coarser than the last, and cascade down a level
+ *      as their expiry approaches. Initialise with timerwheel_create.
+ */
+typedef struct timerwheel_t
+{
+    /** Protects all fields below. Held while callbacks run. */
+    pthread_mutex_t lock;
+    /** Thread which advances the wheel. */
+    pthread_t thread;
+    /** Non-zero while the wheel thread should keep running. */
+    int running;
+    /** Length of a tick, in nanoseconds. */
+    uint64_t tick_ns;
+    /** CLOCK_MONOTONIC time of tick 0, in nanoseconds. */
+    uint64_t start;
+    /** Last tick which has been processed. */
+    uint64_t now;
+    /** Slots of armed timers. */
+    wheel_timer* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+    /** Number of timers which have expired. */
+    unsigned long expired;
+} timerwheel;
+
+/**
+ * \brief   Initialises a timer so it can be armed.
+ *
+ * \param timer The timer to initialise. Not NULL.
+ */
+void wheel_timer_init(wheel_timer* timer);
+
+/**
+ * \brief   Creates a timing wheel, initialising a timerwheel struct and
+ *      starting the thread which expires its timers.
+ *
+ * \param wheel     The timerwheel struct to initialise.
+ * \param tick_ms   Resolution of the wheel in milliseconds. > 0.
+ * \return  0 on success, < 0 on error.
+ */
+int timerwheel_create(timerwheel* wheel, unsigned int tick_ms);
+
+/**
+ * \brief   Destroys a timing wheel, stopping its thread. Armed timers are
+ *      discarded without being called.
+ *
+ * \param wheel The initialised timerwheel to destroy.
+ */
+void timerwheel_destroy(timerwheel* wheel);
+
+/**
+ * \brief   Arms a timer, re-arming it if it is already armed. O(1). The
+ *      callback is run on the wheel's thread with the wheel locked, so must be
+ *      brief and must not arm or cancel timers on the same wheel.
+ *
+ * \param wheel         The initialised timerwheel. Not NULL.
+ * \param timer         The initialised timer. Not NULL.
+ * \param timeout_ms    Time until the timer expires, in milliseconds. Rounded
+ *      up to the wheel's resolution.
+ * \param callback      Function to call on expiry. Not NULL.
+ * \param arg           Argument to pass to callback.
+ */
+void timerwheel_arm(timerwheel* wheel, wheel_timer* timer,
+                    unsigned int timeout_ms, void (*callback)(void*),
+                    void* arg);
+
+/**
+ * \brief   Cancels a timer. O(1). Once this returns the timer's callback is
+ *      neither running nor will it run.
+ *
+ * \param wheel The initialised timerwheel. Not NULL.
+ * \param timer The initialised timer. Not NULL.
+ * \return  1 if the timer was armed and has been cancelled, 0 if it was not
+ *      armed (including if it had already expired).
+ */
+int timerwheel_cancel(timerwheel* wheel, wheel_timer* timer);
+
+#endif // TIMERWHEEL_H